@@ -5,6 +5,7 @@ from datetime import datetime, timedelta
 from ultralytics import YOLO
 from gpiozero import PWMOutputDevice
 import time
+from frame_tap import FrameTap
 
 
 
@@ -28,9 +29,17 @@ model = YOLO("weapon.pt")
 
 last_sent_time = datetime.now() - timedelta(seconds=10)  # Initialize to allow the first send
 
-rtsp_url = "rtsp://127.0.0.1:8554/test"
-cap = cv2.VideoCapture(rtsp_url)
-cap.set(cv2.CAP_PROP_BUFFERSIZE, 1)
+rtsp_url = "rtsp://127.0.0.1:8554/cam0"
+camera_name = "cam0"
+event_socket_path = "/tmp/wbcam_events.sock"  # wbcam_server --record events
+# wbcam_server --tap 가 실행 중이면 공유 메모리에서 축소된 BGR 프레임을 직접 읽음 (디코딩 없음)
+try:
+    tap = FrameTap(camera_name)
+    print(f"Reading {camera_name} from the frame tap ({tap.width}x{tap.height})")
+except OSError:
+    tap = None
+    cap = cv2.VideoCapture(rtsp_url)
+    cap.set(cv2.CAP_PROP_BUFFERSIZE, 1)
 frame_skip = 15
 frame_count = 0
 
@@ -49,16 +58,31 @@ def trigger_buzzer():
         buzzer.off()   # 부저 OFF
  
 
+# 서버에 이벤트 녹화 요청 (pre-roll + post-roll 클립 저장)
+def trigger_recording():
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as event_socket:
+            event_socket.settimeout(0.2)
+            event_socket.connect(event_socket_path)
+            event_socket.sendall(f"TRIGGER {camera_name}\n".encode('utf-8'))
+            print(f"Event recording: {event_socket.recv(256).decode('utf-8').strip()}")
+    except OSError as e:
+        print(f"Event recording request failed: {e}")
+
 
 while True:
     frame_count += 1
     # print("Start Code")
     # Capture a frame from the camera
     # frame = picam2.capture_array()
-    ret, frame = cap.read()
-    if frame_count % frame_skip != 0:
-        continue
-    frame = cv2.resize(frame, None, fx=0.5, fy=0.5)
+    if tap is not None:
+        ret, frame = tap.read(timeout=5.0)
+    else:
+        ret, frame = cap.read()
+        if frame_count % frame_skip != 0:
+            continue
+        if ret:
+            frame = cv2.resize(frame, None, fx=0.5, fy=0.5)
     if not ret:
         print("Error: Can't receive frame (stream end?). Exiting ...")
         break
@@ -98,6 +122,8 @@ while True:
                 # Send image if detection occurred and 10 seconds have passed
                 if detected_objects and (datetime.now() - last_sent_time).total_seconds() >= 10:
                     
+                    trigger_recording()
+
                     detected_time = datetime.now().strftime("%Y-%m-%d %H:%M:%S").encode('utf-8')
                     
                     _, buffer = cv2.imencode('.jpg', frame)
@@ -127,5 +153,7 @@ while True:
 # Close all windows
 # client_socket.close()
 cv2.destroyAllWindows()
+if tap is not None:
+    tap.close()
 
 buzzer.close()
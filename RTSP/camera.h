@@ -0,0 +1,471 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <opencv2/opencv.hpp>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/rtsp-server/rtsp-server.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include "color_convert.h"
+#include "frame_ring.h"
+#include "frame_tap.h"
+#include "motion.h"
+#include "multicast.h"
+#include "native_capture.h"
+#include "rendition.h"
+#include "encoder.h"
+#include "event_recorder.h"
+#include "metrics.h"
+#include "timing_stats.h"
+
+// One line of the camera config: a mount name, where its frames come from
+// and optionally the capture format (defaults to the --size/--fps options)
+// and capture backend (defaults to --capture).
+//   cam0  0              V4L2 device index (/dev/video0)
+//   cam1  /dev/video2    1280x720@30 mjpeg
+//   lobby clip.mp4       video file, replayed at the stream rate
+//   test  videotestsrc   synthetic GStreamer test pattern
+struct CameraConfig {
+    std::string name;
+    std::string source;
+    int width = 800;
+    int height = 600;
+    int fps = 15;
+    bool format_set = false;    // the config line gave its own format
+    int bitrate = 2000;         // kbit/s of the full rendition
+    std::vector<RenditionSpec> ladder = {{"full", 1, 100}};
+    std::string capture = "opencv";   // or a NativeCapture mode: mjpeg, yuyv, nv12
+    bool capture_set = false;   // the config line gave its own backend
+    RecordSettings record;      // record.prefix defaults to the name
+    EventSettings events;       // events.prefix empty: no pre-event ring
+    MotionSettings motion;      // motion.enabled: skip encoding static frames
+    TapSettings tap;            // tap.enabled: shared memory frames for local analytics
+};
+
+// Parses "WIDTHxHEIGHT" or "WIDTHxHEIGHT@FPS".
+inline bool parse_format(const std::string &format, int &width, int &height, int &fps) {
+    int w, h, f = fps;
+    int fields = sscanf(format.c_str(), "%dx%d@%d", &w, &h, &f);
+    if (fields < 2 || w <= 0 || h <= 0 || f <= 0 || w % 2 || h % 2) {
+        return false;
+    }
+    width = w;
+    height = h;
+    fps = f;
+    return true;
+}
+
+inline bool load_camera_config(const std::string &path, std::vector<CameraConfig> &configs) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Error: Could not open config " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(file, line)) {
+        ++line_no;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        CameraConfig config;
+        std::string option;
+        if (!(fields >> config.name >> config.source)) {
+            std::cerr << "Error: " << path << ":" << line_no
+                      << ": expected '<name> <source> [WxH[@FPS]] [opencv|mjpeg|yuyv|nv12]'" << std::endl;
+            return false;
+        }
+        while (fields >> option) {
+            if (option == "opencv" || NativeCapture::valid_mode(option)) {
+                config.capture = option;
+                config.capture_set = true;
+            } else if (parse_format(option, config.width, config.height, config.fps)) {
+                config.format_set = true;
+            } else {
+                std::cerr << "Error: " << path << ":" << line_no << ": bad format " << option << std::endl;
+                return false;
+            }
+        }
+        configs.push_back(config);
+    }
+    return true;
+}
+
+// A capture source with its own capture thread and frame ring, encoded
+// once per rung of its ladder (see Rendition). The full rendition is mounted
+// as /<name> and also feeds the recorders; lower rungs are mounted as
+// /<name>/half and /<name>/quarter. Any number of cameras share one server.
+class Camera {
+public:
+    explicit Camera(const CameraConfig &config)
+        : config(config),
+          ring(config.width, config.height, 4 + 2 * config.ladder.size()),
+          timing(config.fps),
+          labels("camera=\"" + config.name + "\""),
+          capture_stage(metrics::stage(labels, "capture")),
+          handoff_stage(metrics::stage(labels, "handoff")),
+          captured(metrics::Registry::global().counter("wbcam_frames_captured_total",
+                                                      "Frames read from the capture source.", labels)),
+          ring_full(metrics::Registry::global().counter("wbcam_frames_dropped_total",
+                                                       "Frames dropped, by where they were dropped.",
+                                                       labels + ",reason=\"ring_full\"")) {
+        for (const RenditionSpec &spec : config.ladder) {
+            std::string name = spec.divisor == 1 ? config.name : config.name + "/" + spec.name;
+            renditions.emplace_back(new Rendition(name, encoder_settings(config, spec), ring));
+        }
+        if (!native_capture(config)) {
+            convert_stage = &metrics::stage(labels, "convert");
+        }
+        if (!config.events.prefix.empty()) {
+            events.reset(new EventRecorder(config.events));
+        }
+        if (config.motion.enabled) {
+            MotionSettings motion_settings = config.motion;
+            motion_settings.keyframe_interval = gst_util_uint64_scale_int(encoder().get_settings().key_int, GST_SECOND,
+                                                                          config.fps);
+            motion.reset(new MotionGate(config.width, config.height, motion_settings));
+            motion_stage = &metrics::stage(labels, "motion");
+            motion_started = &metrics::Registry::global().counter(
+                "wbcam_motion_started_total", "Times the motion gate went from idle to full rate.", labels);
+            MotionGate *gate = motion.get();
+            exposed.push_back(metrics::Registry::global().expose(
+                "wbcam_frames_skipped_total", "Frames the motion gate kept from the encoders.", "counter", labels,
+                [gate] { return (double)gate->skipped_frames(); }));
+        }
+        if (config.tap.enabled) {
+            tap.reset(new FrameTap(ring, config.name, config.width, config.height,
+                                   native_capture(config) ? NativeCapture::format(config.capture) : "",
+                                   config.tap));
+        }
+    }
+
+    ~Camera() {
+        stop();
+        for (uint64_t id : exposed) {
+            metrics::Registry::global().unexpose(id);
+        }
+    }
+
+    // Sees every frame of the OpenCV capture path, on the capture thread,
+    // before it is converted; wbcam_bench stamps frames with it. Set it
+    // before start().
+    using FrameHook = std::function<void(cv::Mat &)>;
+    void set_frame_hook(FrameHook hook) { frame_hook = hook; }
+
+    const std::string &name() const { return config.name; }
+    FrameRing &frames() { return ring; }
+    TimingStats &timing_stats() { return timing; }
+    FrameTap *frame_tap() { return tap.get(); }
+
+    void print_feed_stats() {
+        for (auto &rendition : renditions) {
+            rendition->print_feed_stats();
+        }
+        if (motion) {
+            g_print("[%s] motion gate: analyzed %" G_GUINT64_FORMAT ", not encoded %" G_GUINT64_FORMAT "\n",
+                    name().c_str(), motion->analyzed_frames(), motion->skipped_frames());
+        }
+    }
+
+    // With `multicast` enabled each rendition streams to a multicast group.
+    void mount(GstRTSPMountPoints *mounts, const MulticastTransport *multicast = nullptr) {
+        for (auto &rendition : renditions) {
+            GstRTSPMediaFactory *factory = rendition->create_factory();
+            if (multicast) {
+                multicast->apply(factory);
+            }
+            gst_rtsp_mount_points_add_factory(mounts, rendition->mount_path().c_str(), factory);
+        }
+    }
+
+    std::vector<std::string> mount_paths() const {
+        std::vector<std::string> paths;
+        for (auto &rendition : renditions) {
+            paths.push_back(rendition->mount_path());
+        }
+        return paths;
+    }
+
+    bool open() {
+        const std::string &source = config.source;
+        if (native_capture()) {
+            // Devices and test sources are live and files are synced to
+            // the clock by the appsink, so the pipeline paces itself.
+            self_paced = true;
+            return native.open(source, config.capture, config.width, config.height, config.fps);
+        }
+
+        bool opened;
+        if (source == "videotestsrc") {
+            std::ostringstream pipeline;
+            pipeline << "videotestsrc is-live=true pattern=ball ! "
+                     << "video/x-raw,width=" << config.width << ",height=" << config.height
+                     << ",framerate=" << config.fps << "/1 ! "
+                     << "videoconvert ! video/x-raw,format=BGR ! appsink drop=true max-buffers=1";
+            opened = cap.open(pipeline.str(), cv::CAP_GSTREAMER);
+            self_paced = true;
+        } else if (!source.empty() && source.find_first_not_of("0123456789") == std::string::npos) {
+            opened = cap.open(std::stoi(source));
+            self_paced = true;
+        } else {
+            opened = cap.open(source);
+            self_paced = source.compare(0, 5, "/dev/") == 0;
+        }
+
+        if (!opened || !cap.isOpened()) {
+            std::cerr << "Error: Could not open " << config.name << " source " << source << std::endl;
+            return false;
+        }
+
+        cap.set(cv::CAP_PROP_FRAME_WIDTH, config.width);
+        cap.set(cv::CAP_PROP_FRAME_HEIGHT, config.height);
+        cap.set(cv::CAP_PROP_FPS, config.fps);
+        return true;
+    }
+
+    bool start() {
+        // Lower rungs share the full encoder's base time, so every encoder
+        // takes the capture timestamps as they are.
+        if (!renditions[0]->start([this](GstSample *sample) { on_encoded(sample); })) {
+            return false;
+        }
+        for (size_t i = 1; i < renditions.size(); ++i) {
+            if (!renditions[i]->start(nullptr, renditions[0].get())) {
+                return false;
+            }
+        }
+
+        if (tap && !tap->start()) {
+            return false;
+        }
+
+        running = true;
+        capture_thread = std::thread(&Camera::capture_loop, this);
+        return true;
+    }
+
+    void stop() {
+        running = false;
+        if (capture_thread.joinable()) {
+            capture_thread.join();
+        }
+        native.close();
+        if (tap) {
+            tap->stop();
+        }
+        for (auto &rendition : renditions) {
+            rendition->stop();
+        }
+    }
+
+    // Writes the pre-roll plus the next `post_roll` to a clip; returns its
+    // file name, or an empty string if event recording is off or not ready.
+    std::string trigger_event(GstClockTime post_roll = GST_CLOCK_TIME_NONE) {
+        return events ? events->trigger(post_roll) : "";
+    }
+
+private:
+    static bool native_capture(const CameraConfig &config) {
+        return config.capture != "opencv";
+    }
+
+    bool native_capture() const {
+        return native_capture(config);
+    }
+
+    static EncoderSettings encoder_settings(const CameraConfig &config, const RenditionSpec &spec) {
+        EncoderSettings settings;
+        settings.width = config.width;
+        settings.height = config.height;
+        settings.fps = config.fps;
+        settings.format = native_capture(config) ? NativeCapture::format(config.capture) : "I420";
+        settings.bitrate = config.bitrate * spec.bitrate_percent / 100;
+        if (spec.divisor > 1) {
+            settings.scale_width = (config.width / spec.divisor) & ~1;
+            settings.scale_height = (config.height / spec.divisor) & ~1;
+        } else {
+            settings.record = config.record;
+        }
+        return settings;
+    }
+
+    Encoder &encoder() {
+        return renditions[0]->get_encoder();
+    }
+
+    // Publishes a captured frame and encodes it, unless the motion gate
+    // finds the scene static. Every frame still reaches the ring.
+    void publish(FrameSlot *slot) {
+        bool encode = true;
+        if (motion) {
+            uint64_t start = metrics::now_ns();
+            encode = motion->admit(slot->i420.data, slot->i420.cols, slot->capture_time);
+            motion_stage->record_since(start);
+        }
+        uint64_t start = metrics::now_ns();
+        ring.publish(slot);
+        handoff_stage.record(handoff_ns + metrics::now_ns() - start);
+        if (motion && motion->state_changed()) {
+            // A flickering scene toggles often: counted, not logged.
+            if (motion->in_motion()) {
+                motion_started->add();
+            }
+            encoder().mark_motion(slot->capture_time, motion->in_motion());
+        }
+        if (encode) {
+            if (motion && motion->wants_keyframe()) {
+                for (auto &rendition : renditions) {
+                    rendition->get_encoder().force_keyframe();
+                }
+            }
+            push_frame();
+        }
+    }
+
+    // Pushes the frame just published to every rendition, exactly once each.
+    void push_frame() {
+        for (auto &rendition : renditions) {
+            rendition->push_frame();
+        }
+    }
+
+    // Full rendition only: latency is measured and event clips are cut there.
+    void on_encoded(GstSample *sample) {
+        GstBuffer *encoded = gst_sample_get_buffer(sample);
+        if (GST_BUFFER_PTS_IS_VALID(encoded)) {
+            GstClockTime now = encoder().running_time();
+            timing.on_send(now > GST_BUFFER_PTS(encoded) ? now - GST_BUFFER_PTS(encoded) : 0);
+        }
+        if (events) {
+            events->push(sample);
+        }
+    }
+
+    // Devices and live test sources block in read() until the next frame,
+    // so they pace the loop themselves; only files are paced here. Each
+    // frame is stamped with the encoder's running time when read() returns.
+    void capture_loop() {
+        if (native_capture()) {
+            native_capture_loop();
+            return;
+        }
+
+        using namespace std::chrono;
+        auto next_frame_time = steady_clock::now();
+        const auto frame_duration = duration_cast<nanoseconds>(duration<double>(1.0 / config.fps));
+
+        while (running) {
+            uint64_t start = metrics::now_ns();
+            FrameSlot *slot = ring.begin_write();
+            handoff_ns = metrics::now_ns() - start;
+            if (!slot) {
+                // Every slot is still queued downstream; drop this frame.
+                cap.grab();
+                ring_full.add();
+            } else {
+                start = metrics::now_ns();
+                if (!cap.read(slot->bgr) || slot->bgr.empty()) {
+                    ring.abort_write(slot);
+                    std::cerr << "Error: " << config.name << " could not capture frame!" << std::endl;
+                    break;
+                }
+                capture_stage.record_since(start);
+                captured.add();
+                if (frame_hook) {
+                    frame_hook(slot->bgr);
+                }
+                slot->capture_time = encoder().running_time();
+                timing.on_capture(slot->capture_time);
+
+                start = metrics::now_ns();
+                bgr_to_i420(slot->bgr, slot->i420);
+                convert_stage->record_since(start);
+                publish(slot);
+            }
+
+            if (!self_paced) {
+                next_frame_time += frame_duration;
+                std::this_thread::sleep_until(next_frame_time);
+            }
+        }
+    }
+
+    // The capture pipeline's buffers become the slot frames as they are:
+    // no BGR, no conversion and no copy on the way to the encoder.
+    void native_capture_loop() {
+        while (running) {
+            uint64_t start = metrics::now_ns();
+            GstSample *sample = native.pull(100 * GST_MSECOND);
+            if (!sample) {
+                if (native.eos()) {
+                    std::cerr << "Error: " << config.name << " capture pipeline stopped!" << std::endl;
+                    break;
+                }
+                continue;
+            }
+            capture_stage.record_since(start);
+            captured.add();
+            GstClockTime capture_time = encoder().running_time();
+
+            start = metrics::now_ns();
+            FrameSlot *slot = ring.begin_write();
+            handoff_ns = metrics::now_ns() - start;
+            if (slot) {
+                if (slot->attach(gst_sample_get_buffer(sample))) {
+                    slot->capture_time = capture_time;
+                    timing.on_capture(capture_time);
+                    publish(slot);
+                } else {
+                    ring.abort_write(slot);
+                    std::cerr << "Error: " << config.name << " captured a frame of unexpected size!" << std::endl;
+                }
+            } else {
+                // Every slot is still queued downstream; drop this frame.
+                ring_full.add();
+            }
+            gst_sample_unref(sample);
+        }
+    }
+
+    CameraConfig config;
+    cv::VideoCapture cap;
+    NativeCapture native;
+    FrameRing ring;
+    std::vector<std::unique_ptr<Rendition>> renditions;
+    std::unique_ptr<EventRecorder> events;
+    std::unique_ptr<MotionGate> motion;
+    std::vector<uint64_t> exposed;          // Registry::expose ids, read from members
+    std::unique_ptr<FrameTap> tap;
+    TimingStats timing;
+    FrameHook frame_hook;
+
+    // Stage timings and frame counters, see metrics.h. A native capture
+    // has no conversion stage; its frames go to the encoders as captured.
+    std::string labels;
+    metrics::Histogram &capture_stage;      // reading the next frame, waiting for it included
+    metrics::Histogram &handoff_stage;      // claiming a ring slot and publishing it
+    metrics::Histogram *convert_stage = nullptr;    // BGR to I420
+    metrics::Histogram *motion_stage = nullptr;
+    metrics::Counter *motion_started = nullptr;
+    metrics::Counter &captured;
+    metrics::Counter &ring_full;
+    uint64_t handoff_ns = 0;                // begin_write() of the frame being captured
+
+    bool self_paced = false;
+    std::atomic<bool> running{false};
+    std::thread capture_thread;
+};
+
+#endif // CAMERA_H
@@ -0,0 +1,258 @@
+#ifndef COLOR_CONVERT_H
+#define COLOR_CONVERT_H
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLOR_CONVERT_AVX2 1
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define COLOR_CONVERT_NEON 1
+#endif
+
+// BGR24 -> planar I420 with the BT.601 video-range integer coefficients
+// OpenCV uses for COLOR_BGR2YUV_I420:
+//   Y = ((66 R + 129 G +  25 B + 128) >> 8) + 16
+//   U = ((-38 R - 74 G + 112 B + 128) >> 8) + 128
+//   V = ((112 R - 94 G -  18 B + 128) >> 8) + 128
+// U and V are taken from the rounded average of each 2x2 block. The planes
+// are written through plain pointers, so the destination can be a mapped
+// GstBuffer or a FrameSlot that is later wrapped without a copy.
+//
+// Width and height must be even. SIMD kernels handle 16 pixels at a time;
+// the remaining columns go through the scalar path.
+
+struct I420Planes {
+    uint8_t *y;
+    uint8_t *u;
+    uint8_t *v;
+    size_t y_stride;
+    size_t uv_stride;
+};
+
+namespace color_convert {
+
+inline uint8_t clamp_u8(int value) {
+    return (uint8_t)(value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+inline void scalar_rows(const uint8_t *row0, const uint8_t *row1, int x_begin, int width,
+                        uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v) {
+    for (int x = x_begin; x < width; x += 2) {
+        int b = 0, g = 0, r = 0;
+        const uint8_t *px[4] = {row0 + x * 3, row0 + x * 3 + 3, row1 + x * 3, row1 + x * 3 + 3};
+        uint8_t *out[4] = {y0 + x, y0 + x + 1, y1 + x, y1 + x + 1};
+        for (int i = 0; i < 4; ++i) {
+            *out[i] = (uint8_t)(((66 * px[i][2] + 129 * px[i][1] + 25 * px[i][0] + 128) >> 8) + 16);
+            b += px[i][0];
+            g += px[i][1];
+            r += px[i][2];
+        }
+        b = (b + 2) >> 2;
+        g = (g + 2) >> 2;
+        r = (r + 2) >> 2;
+        u[x / 2] = clamp_u8(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        v[x / 2] = clamp_u8(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+inline void scalar(const uint8_t *bgr, size_t bgr_stride, int width, int height, const I420Planes &dst) {
+    for (int row = 0; row < height; row += 2) {
+        scalar_rows(bgr + row * bgr_stride, bgr + (row + 1) * bgr_stride, 0, width,
+                    dst.y + row * dst.y_stride, dst.y + (row + 1) * dst.y_stride,
+                    dst.u + row / 2 * dst.uv_stride, dst.v + row / 2 * dst.uv_stride);
+    }
+}
+
+#ifdef COLOR_CONVERT_AVX2
+
+// Splits 16 packed BGR pixels (48 bytes) into three 16-lane u16 vectors.
+__attribute__((target("avx2")))
+inline void avx2_load_bgr16(const uint8_t *src, __m256i &b, __m256i &g, __m256i &r) {
+    const __m128i a = _mm_loadu_si128((const __m128i *)src);
+    const __m128i m = _mm_loadu_si128((const __m128i *)(src + 16));
+    const __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+
+    const __m128i b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i r0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+    __m128i b8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(m, b1)), _mm_shuffle_epi8(c, b2));
+    __m128i g8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(m, g1)), _mm_shuffle_epi8(c, g2));
+    __m128i r8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(m, r1)), _mm_shuffle_epi8(c, r2));
+
+    b = _mm256_cvtepu8_epi16(b8);
+    g = _mm256_cvtepu8_epi16(g8);
+    r = _mm256_cvtepu8_epi16(r8);
+}
+
+__attribute__((target("avx2")))
+inline void avx2_store_y16(uint8_t *dst, __m256i b, __m256i g, __m256i r) {
+    __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(25)));
+    y = _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+    y = _mm256_add_epi16(y, _mm256_set1_epi16(16));
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(y, y), 0x08);
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(packed));
+}
+
+// Sums horizontal pairs of a 16-lane vector into 8 lanes.
+__attribute__((target("avx2")))
+inline __m128i avx2_pair_sum(__m256i v) {
+    __m256i sums = _mm256_hadd_epi16(v, v);
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(sums, 0x08));
+}
+
+__attribute__((target("avx2")))
+inline void avx2(const uint8_t *bgr, size_t bgr_stride, int width, int height, const I420Planes &dst) {
+    const int simd_width = width & ~15;
+    for (int row = 0; row < height; row += 2) {
+        const uint8_t *row0 = bgr + row * bgr_stride;
+        const uint8_t *row1 = row0 + bgr_stride;
+        uint8_t *y0 = dst.y + row * dst.y_stride;
+        uint8_t *y1 = y0 + dst.y_stride;
+        uint8_t *u = dst.u + row / 2 * dst.uv_stride;
+        uint8_t *v = dst.v + row / 2 * dst.uv_stride;
+
+        for (int x = 0; x < simd_width; x += 16) {
+            __m256i b0, g0, r0, b1, g1, r1;
+            avx2_load_bgr16(row0 + x * 3, b0, g0, r0);
+            avx2_load_bgr16(row1 + x * 3, b1, g1, r1);
+            avx2_store_y16(y0 + x, b0, g0, r0);
+            avx2_store_y16(y1 + x, b1, g1, r1);
+
+            const __m128i two = _mm_set1_epi16(2);
+            __m128i b = _mm_srli_epi16(_mm_add_epi16(avx2_pair_sum(_mm256_add_epi16(b0, b1)), two), 2);
+            __m128i g = _mm_srli_epi16(_mm_add_epi16(avx2_pair_sum(_mm256_add_epi16(g0, g1)), two), 2);
+            __m128i r = _mm_srli_epi16(_mm_add_epi16(avx2_pair_sum(_mm256_add_epi16(r0, r1)), two), 2);
+
+            const __m128i bias = _mm_set1_epi16(128);
+            __m128i uu = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(-38)), _mm_mullo_epi16(g, _mm_set1_epi16(-74)));
+            uu = _mm_add_epi16(uu, _mm_mullo_epi16(b, _mm_set1_epi16(112)));
+            uu = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(uu, bias), 8), bias);
+            __m128i vv = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)), _mm_mullo_epi16(g, _mm_set1_epi16(-94)));
+            vv = _mm_add_epi16(vv, _mm_mullo_epi16(b, _mm_set1_epi16(-18)));
+            vv = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(vv, bias), 8), bias);
+
+            _mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(uu, uu));
+            _mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(vv, vv));
+        }
+        scalar_rows(row0, row1, simd_width, width, y0, y1, u, v);
+    }
+}
+
+inline bool avx2_supported() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+#endif // COLOR_CONVERT_AVX2
+
+#ifdef COLOR_CONVERT_NEON
+
+inline uint8x16_t neon_y16(uint8x16x3_t px) {
+    const uint8x8_t ky_r = vdup_n_u8(66), ky_g = vdup_n_u8(129), ky_b = vdup_n_u8(25);
+    uint16x8_t lo = vmull_u8(vget_low_u8(px.val[2]), ky_r);
+    lo = vmlal_u8(lo, vget_low_u8(px.val[1]), ky_g);
+    lo = vmlal_u8(lo, vget_low_u8(px.val[0]), ky_b);
+    uint16x8_t hi = vmull_u8(vget_high_u8(px.val[2]), ky_r);
+    hi = vmlal_u8(hi, vget_high_u8(px.val[1]), ky_g);
+    hi = vmlal_u8(hi, vget_high_u8(px.val[0]), ky_b);
+    uint8x16_t y = vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+    return vaddq_u8(y, vdupq_n_u8(16));
+}
+
+inline uint8x8_t neon_chroma(int16x8_t r, int16x8_t g, int16x8_t b, int16_t kr, int16_t kg, int16_t kb) {
+    int16x8_t c = vmulq_n_s16(r, kr);
+    c = vmlaq_n_s16(c, g, kg);
+    c = vmlaq_n_s16(c, b, kb);
+    c = vshrq_n_s16(vaddq_s16(c, vdupq_n_s16(128)), 8);
+    return vqmovun_s16(vaddq_s16(c, vdupq_n_s16(128)));
+}
+
+inline void neon(const uint8_t *bgr, size_t bgr_stride, int width, int height, const I420Planes &dst) {
+    const int simd_width = width & ~15;
+    for (int row = 0; row < height; row += 2) {
+        const uint8_t *row0 = bgr + row * bgr_stride;
+        const uint8_t *row1 = row0 + bgr_stride;
+        uint8_t *y0 = dst.y + row * dst.y_stride;
+        uint8_t *y1 = y0 + dst.y_stride;
+        uint8_t *u = dst.u + row / 2 * dst.uv_stride;
+        uint8_t *v = dst.v + row / 2 * dst.uv_stride;
+
+        for (int x = 0; x < simd_width; x += 16) {
+            uint8x16x3_t px0 = vld3q_u8(row0 + x * 3);
+            uint8x16x3_t px1 = vld3q_u8(row1 + x * 3);
+            vst1q_u8(y0 + x, neon_y16(px0));
+            vst1q_u8(y1 + x, neon_y16(px1));
+
+            int16x8_t b = vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(px0.val[0]), px1.val[0]), 2));
+            int16x8_t g = vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(px0.val[1]), px1.val[1]), 2));
+            int16x8_t r = vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(px0.val[2]), px1.val[2]), 2));
+            vst1_u8(u + x / 2, neon_chroma(r, g, b, -38, -74, 112));
+            vst1_u8(v + x / 2, neon_chroma(r, g, b, 112, -94, -18));
+        }
+        scalar_rows(row0, row1, simd_width, width, y0, y1, u, v);
+    }
+}
+
+#endif // COLOR_CONVERT_NEON
+
+// Name of the kernel bgr_to_i420() dispatches to on this machine.
+inline const char *kernel_name() {
+#if defined(COLOR_CONVERT_NEON)
+    return "neon";
+#elif defined(COLOR_CONVERT_AVX2)
+    return avx2_supported() ? "avx2" : "scalar";
+#else
+    return "scalar";
+#endif
+}
+
+} // namespace color_convert
+
+inline void bgr_to_i420(const uint8_t *bgr, size_t bgr_stride, int width, int height, const I420Planes &dst) {
+#if defined(COLOR_CONVERT_NEON)
+    color_convert::neon(bgr, bgr_stride, width, height, dst);
+#elif defined(COLOR_CONVERT_AVX2)
+    if (color_convert::avx2_supported()) {
+        color_convert::avx2(bgr, bgr_stride, width, height, dst);
+    } else {
+        color_convert::scalar(bgr, bgr_stride, width, height, dst);
+    }
+#else
+    color_convert::scalar(bgr, bgr_stride, width, height, dst);
+#endif
+}
+
+// Planes of a contiguous I420 image laid out like cv::COLOR_BGR2YUV_I420
+// output: a (height * 3 / 2) x width single-channel Mat.
+inline I420Planes i420_planes(cv::Mat &i420, int width, int height) {
+    I420Planes planes;
+    planes.y = i420.data;
+    planes.u = planes.y + (size_t)width * height;
+    planes.v = planes.u + (size_t)(width / 2) * (height / 2);
+    planes.y_stride = width;
+    planes.uv_stride = width / 2;
+    return planes;
+}
+
+// Drop-in for cv::cvtColor(bgr, i420, cv::COLOR_BGR2YUV_I420) that writes
+// into `i420` in place when it already has the right size.
+inline void bgr_to_i420(const cv::Mat &bgr, cv::Mat &i420) {
+    i420.create(bgr.rows * 3 / 2, bgr.cols, CV_8UC1);
+    bgr_to_i420(bgr.data, bgr.step, bgr.cols, bgr.rows, i420_planes(i420, bgr.cols, bgr.rows));
+}
+
+#endif // COLOR_CONVERT_H
@@ -0,0 +1,159 @@
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/dnn.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct Detection {
+    int class_id;
+    float confidence;
+    cv::Rect box;            // in the coordinates of the frame passed in
+};
+
+struct DetectorSettings {
+    std::string model;       // YOLOv8 ONNX export; batch > 1 needs dynamic=True
+    std::string labels;      // optional, one class name per line
+    int input_size = 640;
+    int batch = 4;
+    float confidence = 0.5f;
+    float nms = 0.45f;
+};
+
+// YOLOv8 object detection on the OpenCV DNN CPU backend, for several frames
+// (usually one per camera) in a single forward pass.
+//
+// Pre-processing letterboxes every frame into a reused gray canvas with one
+// resize, and blobFromImages does the BGR->RGB swap, the 1/255 scale and the
+// HWC->NCHW transpose for the whole batch in one pass. Post-processing
+// transposes each image's [4 + classes, anchors] output once, takes the best
+// class score of every anchor with a single cv::reduce, and only looks at
+// the anchors that clear the threshold before class-aware NMS.
+class Detector {
+public:
+    explicit Detector(const DetectorSettings &settings) : settings(settings) {}
+
+    bool load() {
+        net = cv::dnn::readNetFromONNX(settings.model);
+        if (net.empty()) {
+            std::cerr << "Error: Could not load model " << settings.model << std::endl;
+            return false;
+        }
+        net.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+        net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+
+        if (!settings.labels.empty()) {
+            std::ifstream file(settings.labels);
+            std::string line;
+            while (std::getline(file, line)) {
+                names.push_back(line);
+            }
+        }
+        return true;
+    }
+
+    std::string class_name(int class_id) const {
+        if (class_id >= 0 && class_id < (int)names.size()) {
+            return names[class_id];
+        }
+        return "class" + std::to_string(class_id);
+    }
+
+    // Detections for every frame, in order. At most `batch` frames per call.
+    std::vector<std::vector<Detection>> detect(const std::vector<cv::Mat> &frames) {
+        std::vector<Letterbox> boxes(frames.size());
+        canvases.resize(frames.size());
+        for (size_t i = 0; i < frames.size(); ++i) {
+            boxes[i] = letterbox(frames[i], canvases[i]);
+        }
+
+        cv::Mat blob = cv::dnn::blobFromImages(canvases, 1.0 / 255.0,
+                                               cv::Size(settings.input_size, settings.input_size),
+                                               cv::Scalar(), true, false, CV_32F);
+        net.setInput(blob);
+        cv::Mat output = net.forward();
+
+        // [batch, 4 + classes, anchors]
+        const int attributes = output.size[1];
+        const int anchors = output.size[2];
+        std::vector<std::vector<Detection>> results;
+        for (size_t i = 0; i < frames.size(); ++i) {
+            cv::Mat prediction(attributes, anchors, CV_32F, output.ptr<float>((int)i));
+            results.push_back(postprocess(prediction.t(), boxes[i], frames[i].size()));
+        }
+        return results;
+    }
+
+    const DetectorSettings &get_settings() const { return settings; }
+
+private:
+    struct Letterbox {
+        float scale;
+        int pad_x;
+        int pad_y;
+    };
+
+    Letterbox letterbox(const cv::Mat &frame, cv::Mat &canvas) const {
+        const int size = settings.input_size;
+        Letterbox box;
+        box.scale = std::min((float)size / frame.cols, (float)size / frame.rows);
+        int width = std::max(1, (int)std::round(frame.cols * box.scale));
+        int height = std::max(1, (int)std::round(frame.rows * box.scale));
+        box.pad_x = (size - width) / 2;
+        box.pad_y = (size - height) / 2;
+
+        if (canvas.rows != size || canvas.cols != size) {
+            canvas.create(size, size, CV_8UC3);
+        }
+        canvas.setTo(cv::Scalar(114, 114, 114));
+        cv::Mat inner = canvas(cv::Rect(box.pad_x, box.pad_y, width, height));
+        cv::resize(frame, inner, inner.size(), 0, 0, cv::INTER_LINEAR);
+        return box;
+    }
+
+    // `rows` is [anchors, 4 + classes]: cx, cy, w, h, then one score per class.
+    std::vector<Detection> postprocess(const cv::Mat &rows, const Letterbox &box, cv::Size frame) const {
+        cv::Mat scores = rows.colRange(4, rows.cols);
+        cv::Mat best;
+        cv::reduce(scores, best, 1, cv::REDUCE_MAX);
+
+        std::vector<cv::Rect> rects;
+        std::vector<float> confidences;
+        std::vector<int> class_ids;
+        for (int i = 0; i < rows.rows; ++i) {
+            float confidence = best.at<float>(i, 0);
+            if (confidence < settings.confidence) {
+                continue;
+            }
+            cv::Point class_id;
+            cv::minMaxLoc(scores.row(i), nullptr, nullptr, nullptr, &class_id);
+
+            const float *row = rows.ptr<float>(i);
+            float x = (row[0] - row[2] / 2 - box.pad_x) / box.scale;
+            float y = (row[1] - row[3] / 2 - box.pad_y) / box.scale;
+            cv::Rect rect((int)x, (int)y, (int)(row[2] / box.scale), (int)(row[3] / box.scale));
+            rects.push_back(rect & cv::Rect(0, 0, frame.width, frame.height));
+            confidences.push_back(confidence);
+            class_ids.push_back(class_id.x);
+        }
+
+        std::vector<int> keep;
+        cv::dnn::NMSBoxesBatched(rects, confidences, class_ids, settings.confidence, settings.nms, keep);
+        std::vector<Detection> detections;
+        for (int i : keep) {
+            detections.push_back({class_ids[i], confidences[i], rects[i]});
+        }
+        return detections;
+    }
+
+    DetectorSettings settings;
+    cv::dnn::Net net;
+    std::vector<std::string> names;
+    std::vector<cv::Mat> canvases;
+};
+
+#endif // DETECTOR_H
@@ -0,0 +1,250 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <functional>
+#include <sstream>
+#include <string>
+#include "recorder.h"
+
+struct EncoderSettings {
+    int width = 800;
+    int height = 600;
+    int fps = 15;
+    std::string format = "I420";     // raw format pushed into `raw`
+    int scale_width = 0;             // encode at this size; 0 keeps the input size
+    int scale_height = 0;
+    int bitrate = 2000;              // kbit/s
+    int key_int = 15;
+    RecordSettings record;
+    bool live = true;                // false makes push-buffer block instead (offline benchmarks)
+    guint64 max_queue_bytes = 0;     // raw frames queued in appsrc; 0 means three frames
+};
+
+// The only H.264 encoder of a camera. Raw I420 frames go in through the
+// `raw` appsrc, get encoded once and are teed to
+//   - the `live` appsink, whose samples are fanned out to RTSP clients, and
+//   - a SegmentRecorder branch that records segments without re-encoding.
+class Encoder {
+public:
+    using SampleCallback = std::function<void(GstSample *)>;
+
+    Encoder(const std::string &name, const EncoderSettings &settings)
+        : name(name), settings(settings), recorder(settings.record) {
+        if (this->settings.max_queue_bytes == 0) {
+            this->settings.max_queue_bytes = (guint64)settings.width * settings.height * 3 / 2 * 3;
+        }
+    }
+
+    ~Encoder() {
+        stop();
+    }
+
+    std::string launch_string() const {
+        std::ostringstream launch;
+        launch << "appsrc name=raw format=time max-bytes=" << settings.max_queue_bytes;
+        if (settings.live) {
+            // A live feed must never block the capture thread: drop the
+            // oldest queued frame instead.
+            launch << " is-live=true block=false leaky-type=downstream ! ";
+        } else {
+            launch << " is-live=false block=true ! ";
+        }
+        if (!x264_accepts(settings.format)) {
+            launch << "videoconvert ! ";
+        }
+        if (settings.scale_width > 0 && settings.scale_height > 0) {
+            launch << "videoscale ! video/x-raw,width=" << settings.scale_width
+                   << ",height=" << settings.scale_height << " ! ";
+        }
+        launch << "x264enc name=enc tune=zerolatency speed-preset=ultrafast bitrate=" << settings.bitrate
+               << " key-int-max=" << settings.key_int << " ! "
+               << "h264parse config-interval=-1 ! "
+               << "video/x-h264,stream-format=byte-stream,alignment=au ! "
+               << "tee name=t "
+               << "t. ! queue leaky=downstream max-size-buffers=30 ! "
+               << "appsink name=live sync=false max-buffers=30 drop=true ";
+        if (recorder.enabled()) {
+            launch << "t. ! queue ! h264parse ! " << recorder.launch_fragment();
+        }
+        return launch.str();
+    }
+
+    // Raw formats x264enc takes directly; anything else needs videoconvert.
+    static bool x264_accepts(const std::string &format) {
+        return format == "I420" || format == "YV12" || format == "NV12" ||
+               format == "Y42B" || format == "Y444";
+    }
+
+    // `time_base`, if given, must already be running; this encoder then
+    // shares its base time, so one capture timestamp is a valid PTS for both.
+    bool start(SampleCallback callback, const Encoder *time_base = nullptr) {
+        on_sample = callback;
+
+        GError *error = nullptr;
+        pipeline = gst_parse_launch(launch_string().c_str(), &error);
+        if (!pipeline) {
+            g_printerr("%s: Failed to create encoder: %s\n", name.c_str(), error ? error->message : "unknown error");
+            g_clear_error(&error);
+            return false;
+        }
+
+        appsrc = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(pipeline), "raw"));
+        gst_app_src_set_stream_type(appsrc, GST_APP_STREAM_TYPE_STREAM);
+        GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                           "format", G_TYPE_STRING, settings.format.c_str(),
+                                           "width", G_TYPE_INT, settings.width,
+                                           "height", G_TYPE_INT, settings.height,
+                                           "framerate", GST_TYPE_FRACTION, settings.fps, 1,
+                                           NULL);
+        gst_app_src_set_caps(appsrc, caps);
+        gst_caps_unref(caps);
+
+        GstElement *live = gst_bin_get_by_name(GST_BIN(pipeline), "live");
+        GstAppSinkCallbacks callbacks = {};
+        callbacks.new_sample = new_sample;
+        gst_app_sink_set_callbacks(GST_APP_SINK(live), &callbacks, this, NULL);
+        gst_object_unref(live);
+
+        GstElement *rec = gst_bin_get_by_name(GST_BIN(pipeline), "rec");
+        if (rec) {
+            recorder.attach(rec);
+            gst_object_unref(rec);
+        }
+
+        // Pin the system clock so running_time() is valid from the start and
+        // capture timestamps and buffer PTS share one time base.
+        clock = gst_system_clock_obtain();
+        gst_pipeline_use_clock(GST_PIPELINE(pipeline), clock);
+        if (time_base && time_base->pipeline) {
+            gst_element_set_start_time(pipeline, GST_CLOCK_TIME_NONE);
+            gst_element_set_base_time(pipeline, gst_element_get_base_time(time_base->pipeline));
+        }
+
+        GstBus *bus = gst_element_get_bus(pipeline);
+        bus_watch = gst_bus_add_watch(bus, bus_message, this);
+        gst_object_unref(bus);
+
+        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+            g_printerr("%s: Failed to start encoder\n", name.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Drains the encoder so the current recording segment is finalized.
+    void stop() {
+        if (!pipeline) {
+            return;
+        }
+
+        gst_app_src_end_of_stream(appsrc);
+        GstBus *bus = gst_element_get_bus(pipeline);
+        GstMessage *msg = gst_bus_timed_pop_filtered(bus, 5 * GST_SECOND,
+                                                     (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+        if (msg) {
+            gst_message_unref(msg);
+        }
+        gst_object_unref(bus);
+
+        if (bus_watch) {
+            g_source_remove(bus_watch);
+            bus_watch = 0;
+        }
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(appsrc);
+        gst_object_unref(pipeline);
+        gst_object_unref(clock);
+        appsrc = nullptr;
+        pipeline = nullptr;
+        clock = nullptr;
+    }
+
+    // Current running time of the encoder pipeline, the time base of every
+    // PTS it produces. GST_CLOCK_TIME_NONE until the pipeline is started.
+    GstClockTime running_time() const {
+        if (!clock) {
+            return GST_CLOCK_TIME_NONE;
+        }
+        GstClockTime now = gst_clock_get_time(clock);
+        GstClockTime base = gst_element_get_base_time(pipeline);
+        return now > base ? now - base : 0;
+    }
+
+    // Tags the recorded segments with a motion interval starting or ending at `pts`.
+    void mark_motion(GstClockTime pts, bool moving) {
+        recorder.mark_motion(pts, moving);
+    }
+
+    // Times the recorded access units from capture to the segment file;
+    // call before start().
+    void set_record_latency(metrics::Histogram *histogram) {
+        recorder.set_latency_histogram(histogram);
+    }
+
+    // x264enc applies a new bitrate from the next frame on, while playing.
+    void set_bitrate(int kbps) {
+        if (!pipeline) {
+            return;
+        }
+        GstElement *enc = gst_bin_get_by_name(GST_BIN(pipeline), "enc");
+        g_object_set(enc, "bitrate", (guint)kbps, NULL);
+        gst_object_unref(enc);
+    }
+
+    // Makes the next frame a keyframe, through the same upstream
+    // GstForceKeyUnit event splitmuxsink sends.
+    void force_keyframe() {
+        if (!pipeline) {
+            return;
+        }
+        GstElement *enc = gst_bin_get_by_name(GST_BIN(pipeline), "enc");
+        GstStructure *request = gst_structure_new("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN, TRUE, NULL);
+        gst_element_send_event(enc, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, request));
+        gst_object_unref(enc);
+    }
+
+    GstAppSrc *source() { return appsrc; }
+    GstElement *element() { return pipeline; }
+    const EncoderSettings &get_settings() const { return settings; }
+
+private:
+    static GstFlowReturn new_sample(GstAppSink *sink, gpointer user_data) {
+        Encoder *encoder = static_cast<Encoder *>(user_data);
+        GstSample *sample = gst_app_sink_pull_sample(sink);
+        if (!sample) {
+            return GST_FLOW_EOS;
+        }
+        if (encoder->on_sample) {
+            encoder->on_sample(sample);
+        }
+        gst_sample_unref(sample);
+        return GST_FLOW_OK;
+    }
+
+    static gboolean bus_message(GstBus *bus, GstMessage *msg, gpointer user_data) {
+        Encoder *encoder = static_cast<Encoder *>(user_data);
+        if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+            GError *error = nullptr;
+            gst_message_parse_error(msg, &error, NULL);
+            g_printerr("%s: Encoder error: %s\n", encoder->name.c_str(), error->message);
+            g_error_free(error);
+        } else if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ELEMENT) {
+            encoder->recorder.handle_message(msg);
+        }
+        return TRUE;
+    }
+
+    std::string name;
+    EncoderSettings settings;
+    SegmentRecorder recorder;
+    SampleCallback on_sample;
+    GstElement *pipeline = nullptr;
+    GstAppSrc *appsrc = nullptr;
+    GstClock *clock = nullptr;
+    guint bus_watch = 0;
+};
+
+#endif // ENCODER_H
@@ -0,0 +1,341 @@
+#ifndef EVENT_DISPATCHER_H
+#define EVENT_DISPATCHER_H
+
+#include <opencv2/opencv.hpp>
+#include <gst/gst.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "upload_protocol.h"
+
+// The frame a detection was made on, copied once when the event is let
+// through. The JPEG is encoded on first use by whichever sink needs it, on
+// that sink's thread, and then shared.
+class Snapshot {
+public:
+    Snapshot(const cv::Mat &frame, const cv::Rect &box, const std::string &label)
+        : frame(frame.clone()), box(box), label(label) {}
+
+    const std::vector<unsigned char> &jpeg() {
+        std::call_once(encoded, [this] {
+            cv::Mat annotated = frame.clone();
+            cv::rectangle(annotated, box, cv::Scalar(0, 0, 255), 2);
+            cv::putText(annotated, label, cv::Point(box.x, std::max(box.y - 7, 12)),
+                        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 255), 1);
+            cv::imencode(".jpg", annotated, data);
+        });
+        return data;
+    }
+
+private:
+    cv::Mat frame;
+    cv::Rect box;
+    std::string label;
+    std::once_flag encoded;
+    std::vector<unsigned char> data;
+};
+
+struct DetectionEvent {
+    std::string camera;
+    std::string label;
+    float confidence;
+    std::chrono::system_clock::time_point time;
+    std::shared_ptr<Snapshot> snapshot;
+
+    // "YYYY-mm-dd HH:MM:SS", the format Client.py sent.
+    std::string time_string() const {
+        std::time_t t = std::chrono::system_clock::to_time_t(time);
+        char text[32];
+        std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", std::localtime(&t));
+        return text;
+    }
+};
+
+// One side effect of a detection. handle() runs on the sink's own thread
+// and may block for as long as it needs; it never delays detection or the
+// other sinks.
+class EventSink {
+public:
+    virtual ~EventSink() {}
+    virtual const char *name() const = 0;
+    virtual void handle(const DetectionEvent &event) = 0;
+    virtual void print_stats() {}
+};
+
+// Pulses a GPIO line through its sysfs value file: two 100 ms beeps, as
+// Client.py drove the buzzer. Any writable file works as a stand-in line.
+class GpioSink : public EventSink {
+public:
+    explicit GpioSink(const std::string &value_path) : value_path(value_path) {}
+
+    const char *name() const override { return "gpio"; }
+
+    void handle(const DetectionEvent &) override {
+        for (int beep = 0; beep < 2; ++beep) {
+            set(true);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            set(false);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+private:
+    void set(bool on) {
+        std::ofstream value(value_path);
+        value << (on ? "1" : "0") << std::flush;
+        if (!value) {
+            std::cerr << "Error: could not write GPIO " << value_path << std::endl;
+        }
+    }
+
+    std::string value_path;
+};
+
+// Uploads the JPEG snapshot to event_receiver with the acknowledged protocol
+// of upload_protocol.h. Events are handed to the uploader's own queue and
+// thread, so a dead link only delays the upload, and unacknowledged events
+// are resent when it comes back.
+class UploadSink : public EventSink {
+public:
+    explicit UploadSink(const upload::UploadSettings &settings) : uploader(settings) {
+        uploader.start();
+    }
+
+    const char *name() const override { return "upload"; }
+
+    void handle(const DetectionEvent &event) override {
+        uint64_t time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            event.time.time_since_epoch()).count();
+        uploader.enqueue(event.camera, event.label, event.confidence, time_ms, event.snapshot->jpeg());
+    }
+
+    void print_stats() override {
+        uploader.print_stats();
+    }
+
+private:
+    upload::Uploader uploader;
+};
+
+// Saves the snapshot as <dir>/<camera>_<time>_<label>.jpg and appends a line
+// to <dir>/events.log.
+class FileSink : public EventSink {
+public:
+    explicit FileSink(const std::string &dir) : dir(dir) {}
+
+    const char *name() const override { return "file"; }
+
+    void handle(const DetectionEvent &event) override {
+        std::time_t t = std::chrono::system_clock::to_time_t(event.time);
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y-%m-%d_%H-%M-%S", std::localtime(&t));
+        std::string path = dir + "/" + event.camera + "_" + stamp + "_" + event.label + ".jpg";
+
+        const std::vector<unsigned char> &jpeg = event.snapshot->jpeg();
+        std::ofstream image(path, std::ios::binary);
+        image.write(reinterpret_cast<const char *>(jpeg.data()), jpeg.size());
+
+        std::ofstream log(dir + "/events.log", std::ios::app);
+        log << event.time_string() << " " << event.camera << " " << event.label << " "
+            << event.confidence << " " << path << "\n";
+    }
+
+private:
+    std::string dir;
+};
+
+// Asks wbcam_server for an event clip (TRIGGER <camera> on its event socket).
+class RecordingSink : public EventSink {
+public:
+    explicit RecordingSink(const std::string &event_socket) : event_socket(event_socket) {}
+
+    const char *name() const override { return "recording"; }
+
+    void handle(const DetectionEvent &event) override {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, event_socket.c_str(), sizeof(addr.sun_path) - 1);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            std::cerr << "Event recording request failed: " << strerror(errno) << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+
+        std::string request = "TRIGGER " + event.camera + "\n";
+        char reply[256] = {0};
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (write(fd, request.data(), request.size()) == (ssize_t)request.size() &&
+            poll(&pfd, 1, 200) > 0 && read(fd, reply, sizeof(reply) - 1) > 0) {
+            g_print("Event recording: %s", reply);
+        }
+        close(fd);
+    }
+
+private:
+    std::string event_socket;
+};
+
+struct DispatchSettings {
+    std::chrono::milliseconds class_interval{10000};   // per camera and class
+    std::chrono::milliseconds camera_interval{1000};   // per camera, any class
+    size_t queue_size = 16;                            // per sink; the oldest event is dropped
+};
+
+// Turns detections into side effects without ever blocking the caller.
+//
+// post() debounces first: an event passes only if its camera has been quiet
+// for camera_interval and its camera/class pair for class_interval. A passed
+// event is queued to every sink; each sink has its own bounded queue and
+// worker thread, so a stuck upload neither delays the buzzer nor detection.
+// A full queue drops its oldest event, which is counted.
+class EventDispatcher {
+public:
+    explicit EventDispatcher(const DispatchSettings &settings) : settings(settings) {}
+
+    ~EventDispatcher() {
+        stop();
+    }
+
+    // Takes ownership; call before start().
+    void add_sink(EventSink *sink) {
+        workers.emplace_back(new Worker(sink, settings.queue_size));
+    }
+
+    void start() {
+        for (auto &worker : workers) {
+            worker->thread = std::thread(&Worker::run, worker.get());
+        }
+    }
+
+    void stop() {
+        for (auto &worker : workers) {
+            worker->stop();
+        }
+    }
+
+    // Returns true if the detection got past debouncing. `frame` is only
+    // copied in that case.
+    bool post(const std::string &camera, const std::string &label, float confidence,
+              const cv::Mat &frame, const cv::Rect &box) {
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto camera_last = last_camera.find(camera);
+            auto class_last = last_class.find(camera + "/" + label);
+            if ((camera_last != last_camera.end() && now - camera_last->second < settings.camera_interval) ||
+                (class_last != last_class.end() && now - class_last->second < settings.class_interval)) {
+                ++debounced;
+                return false;
+            }
+            last_camera[camera] = now;
+            last_class[camera + "/" + label] = now;
+        }
+
+        char confidence_text[16];
+        snprintf(confidence_text, sizeof(confidence_text), " %.2f", confidence);
+        DetectionEvent event = {camera, label, confidence, std::chrono::system_clock::now(),
+                                std::make_shared<Snapshot>(frame, box, label + confidence_text)};
+        for (auto &worker : workers) {
+            worker->push(event);
+        }
+        return true;
+    }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        g_print("Events debounced: %" G_GUINT64_FORMAT "\n", debounced);
+        for (auto &worker : workers) {
+            g_print("  %s: handled %" G_GUINT64_FORMAT ", dropped %" G_GUINT64_FORMAT "\n",
+                    worker->sink->name(), worker->handled.load(), worker->dropped.load());
+            worker->sink->print_stats();
+        }
+    }
+
+private:
+    struct Worker {
+        Worker(EventSink *sink, size_t capacity) : sink(sink), capacity(capacity) {}
+
+        ~Worker() {
+            stop();
+        }
+
+        void push(const DetectionEvent &event) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (queue.size() >= capacity) {
+                    queue.pop_front();
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                }
+                queue.push_back(event);
+            }
+            wake.notify_one();
+        }
+
+        void run() {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                wake.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                DetectionEvent event = queue.front();
+                queue.pop_front();
+                lock.unlock();
+                sink->handle(event);
+                handled.fetch_add(1, std::memory_order_relaxed);
+                lock.lock();
+            }
+        }
+
+        // Lets the queue drain, then joins.
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+
+        std::unique_ptr<EventSink> sink;
+        size_t capacity;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<DetectionEvent> queue;
+        bool stopping = false;
+        std::thread thread;
+        std::atomic<guint64> handled{0};
+        std::atomic<guint64> dropped{0};
+    };
+
+    DispatchSettings settings;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex mutex;
+    std::map<std::string, std::chrono::steady_clock::time_point> last_camera;
+    std::map<std::string, std::chrono::steady_clock::time_point> last_class;
+    guint64 debounced = 0;
+};
+
+#endif // EVENT_DISPATCHER_H
@@ -0,0 +1,303 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "upload_protocol.h"
+
+// Receives detection events from wbcam_detector --upload and stores the
+// snapshots as <dir>/<camera>_<time>_<label>_<seq>.jpg, with one line per
+// event in <dir>/events.log. An event is only acknowledged once its file has
+// been synced, so whatever the sender drops after an ACK is safely on disk.
+// See upload_protocol.h for the wire format.
+
+static std::atomic<bool> running{true};
+
+static void handle_signal(int) {
+    running = false;
+}
+
+// The camera and label come from the network and end up in a file name: keep
+// them to one harmless path component.
+static std::string safe_name(const std::string &field) {
+    std::string name = field;
+    for (char &c : name) {
+        if (!std::isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.') {
+            c = '_';
+        }
+    }
+    if (name.empty() || name[0] == '.') {
+        name.insert(0, "_");    // no ".", ".." or hidden files
+    }
+    return name;
+}
+
+struct Connection {
+    int socket;
+    std::string sender;          // empty until HELLO
+    upload::Parser parser;
+    std::vector<int> unsynced;   // files written since the last ACK
+};
+
+class Receiver {
+public:
+    explicit Receiver(const std::string &dir) : dir(dir) {}
+
+    // Returns false once the connection should be closed.
+    bool handle(Connection &connection) {
+        char buffer[64 * 1024];
+        ssize_t n = read(connection.socket, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return false;
+        }
+        connection.parser.feed(buffer, n);
+
+        upload::Header header;
+        std::vector<uint8_t> payload;
+        for (;;) {
+            upload::Parser::Result result = connection.parser.next(header, payload);
+            if (result == upload::Parser::NEED_MORE) {
+                return true;
+            }
+            if (result == upload::Parser::BAD) {
+                std::cerr << "Dropping " << describe(connection) << ": bad header or CRC" << std::endl;
+                return false;
+            }
+            if (!handle_message(connection, header, payload)) {
+                return false;
+            }
+        }
+    }
+
+    void drop(Connection &connection) {
+        // Written but not acknowledged yet. They count as stored, so sync
+        // them now; the resends that follow are then skipped as duplicates.
+        for (int fd : connection.unsynced) {
+            fdatasync(fd);
+            close(fd);
+        }
+        close(connection.socket);
+    }
+
+private:
+    bool handle_message(Connection &connection, const upload::Header &header, const std::vector<uint8_t> &payload) {
+        if (header.type == upload::HELLO) {
+            connection.sender.assign(payload.begin(), payload.end());
+            uint64_t resume = last_seq[connection.sender];
+            std::cout << "Sender " << connection.sender << " connected, resuming after #" << resume << std::endl;
+            return send_ack(connection, resume);
+        }
+        if (header.type != upload::EVENT || connection.sender.empty()) {
+            std::cerr << "Dropping " << describe(connection) << ": unexpected message type "
+                      << (int)header.type << std::endl;
+            return false;
+        }
+
+        uint64_t &last = last_seq[connection.sender];
+        if (header.seq > last) {
+            if (header.seq > last + 1 && last > 0) {
+                std::cerr << connection.sender << " skipped events #" << last + 1 << " to #"
+                          << header.seq - 1 << " (dropped by the sender)" << std::endl;
+            }
+            if (!store(connection, header.seq, payload)) {
+                return false;
+            }
+            last = header.seq;
+        }
+        // else a resend of an event already on disk
+
+        if (header.flags & upload::ACK_REQUEST) {
+            for (int fd : connection.unsynced) {
+                fdatasync(fd);
+                close(fd);
+            }
+            connection.unsynced.clear();
+            return send_ack(connection, last);
+        }
+        return true;
+    }
+
+    bool store(Connection &connection, uint64_t seq, const std::vector<uint8_t> &payload) {
+        auto end = std::find(payload.begin(), payload.end(), '\n');
+        if (end == payload.end()) {
+            std::cerr << "Dropping " << describe(connection) << ": event without metadata" << std::endl;
+            return false;
+        }
+
+        // camera label... confidence time_ms; class names may contain spaces.
+        std::istringstream fields(std::string(payload.begin(), end));
+        std::vector<std::string> words;
+        std::string word;
+        while (fields >> word) {
+            words.push_back(word);
+        }
+        if (words.size() < 4) {
+            std::cerr << "Dropping " << describe(connection) << ": bad metadata" << std::endl;
+            return false;
+        }
+        std::string camera = safe_name(words[0]);
+        std::string label = words[1];
+        for (size_t i = 2; i + 2 < words.size(); ++i) {
+            label += "_" + words[i];
+        }
+        label = safe_name(label);
+        std::string confidence = words[words.size() - 2];
+        time_t time = std::strtoull(words.back().c_str(), nullptr, 10) / 1000;
+
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "%Y-%m-%d_%H-%M-%S", std::localtime(&time));
+        std::string path = dir + "/" + camera + "_" + stamp + "_" + label + "_" + std::to_string(seq) + ".jpg";
+
+        const uint8_t *jpeg = &*end + 1;
+        size_t size = payload.data() + payload.size() - jpeg;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || write(fd, jpeg, size) != (ssize_t)size) {
+            std::cerr << "Error: could not write " << path << ": " << strerror(errno) << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        connection.unsynced.push_back(fd);
+
+        char when[32];
+        std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", std::localtime(&time));
+        std::ofstream log(dir + "/events.log", std::ios::app);
+        log << when << " " << camera << " " << label << " " << confidence << " " << path << "\n";
+        std::cout << "[" << camera << "] " << label << " " << confidence << " -> " << path << std::endl;
+        return true;
+    }
+
+    bool send_ack(Connection &connection, uint64_t seq) {
+        upload::Header ack;
+        ack.type = upload::ACK;
+        ack.seq = seq;
+        uint8_t buffer[upload::HEADER_SIZE];
+        ack.encode(buffer);
+        return send(connection.socket, buffer, sizeof(buffer), MSG_NOSIGNAL) == (ssize_t)sizeof(buffer);
+    }
+
+    static std::string describe(const Connection &connection) {
+        return connection.sender.empty() ? "connection" : connection.sender;
+    }
+
+    std::string dir;
+    // Per sender, the newest event on disk. Senders pick a new id each run,
+    // and after a restart of the receiver they simply resend what they have
+    // not seen acknowledged.
+    std::map<std::string, uint64_t> last_seq;
+};
+
+static void print_usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [--port N] [--bind ADDR] [--dir DIR]" << std::endl
+              << "  --port N     TCP port to listen on (default 8555)" << std::endl
+              << "  --bind ADDR  address to listen on (default 127.0.0.1; :: for all)" << std::endl
+              << "  --dir DIR    where to store snapshots and events.log (default .)" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 8555;
+    std::string bind_address = "127.0.0.1";
+    std::string dir = ".";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--port" && has_value) {
+            char *end = nullptr;
+            long value = std::strtol(argv[++i], &end, 10);
+            if (*end || value <= 0 || value > 65535) {
+                print_usage(argv[0]);
+                return -1;
+            }
+            port = value;
+        } else if (arg == "--bind" && has_value) {
+            bind_address = argv[++i];
+        } else if (arg == "--dir" && has_value) {
+            dir = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return arg == "--help" ? 0 : -1;
+        }
+    }
+
+    // Nothing authenticates the senders, so only loopback unless asked for.
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+    if (inet_pton(AF_INET, bind_address.c_str(), &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        addr_len = sizeof(*addr4);
+    } else if (inet_pton(AF_INET6, bind_address.c_str(), &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        addr_len = sizeof(*addr6);
+    } else {
+        std::cerr << "Error: --bind needs a numeric IPv4 or IPv6 address" << std::endl;
+        return -1;
+    }
+
+    int listen_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int off = 0, on = 1;
+    if (addr.ss_family == AF_INET6) {
+        setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, addr_len) < 0 || listen(listen_fd, 8) < 0) {
+        perror("bind");
+        return -1;
+    }
+    std::cout << "Receiving events on " << bind_address << " port " << port << " into " << dir << std::endl;
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    Receiver receiver(dir);
+    std::vector<Connection> connections;
+    while (running) {
+        std::vector<struct pollfd> fds = {{listen_fd, POLLIN, 0}};
+        for (const Connection &connection : connections) {
+            fds.push_back({connection.socket, POLLIN, 0});
+        }
+        if (poll(fds.data(), fds.size(), 500) <= 0) {
+            continue;
+        }
+
+        // Walk backwards so erasing a connection keeps the other indexes valid.
+        for (size_t i = fds.size() - 1; i > 0; --i) {
+            if (fds[i].revents && !receiver.handle(connections[i - 1])) {
+                receiver.drop(connections[i - 1]);
+                connections.erase(connections.begin() + (i - 1));
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0) {
+                connections.push_back({client, "", upload::Parser(), {}});
+            }
+        }
+    }
+
+    for (Connection &connection : connections) {
+        receiver.drop(connection);
+    }
+    close(listen_fd);
+    return 0;
+}
@@ -0,0 +1,237 @@
+#ifndef EVENT_RECORDER_H
+#define EVENT_RECORDER_H
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "recorder.h"
+
+struct EventSettings {
+    std::string prefix;                          // empty disables event recording
+    GstClockTime pre_roll = 10 * GST_SECOND;
+    GstClockTime post_roll = 20 * GST_SECOND;
+    size_t max_bytes = 32 * 1024 * 1024;         // cap on the pre-roll ring
+};
+
+// Records only around events. The last `pre_roll` of encoded access units
+// is kept in memory (whole GOPs, bounded by `max_bytes`); trigger() writes
+// that pre-roll plus the following `post_roll` to `<prefix>_event_<time>.mp4`,
+// the time with milliseconds.
+// A trigger during a running clip extends it instead of starting another.
+//
+// The buffers are the encoder's own, referenced rather than copied, and a
+// clip is only muxed, never re-encoded.
+class EventRecorder {
+public:
+    explicit EventRecorder(const EventSettings &settings)
+        : settings(settings), finalizer(&EventRecorder::finalize_clips, this) {}
+
+    ~EventRecorder() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (clip.pipeline) {
+                finish_clip();
+            }
+            clear_preroll();
+            if (caps) {
+                gst_caps_unref(caps);
+            }
+            stopping = true;
+        }
+        finished.notify_one();
+        finalizer.join();
+    }
+
+    // Called for every encoded access unit on the encoder's streaming thread.
+    void push(GstSample *sample) {
+        GstBuffer *buffer = gst_sample_get_buffer(sample);
+        bool keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!caps) {
+            caps = gst_caps_ref(gst_sample_get_caps(sample));
+        }
+        last_pts = GST_BUFFER_PTS(buffer);
+
+        if (clip.pipeline) {
+            push_to_clip(buffer);
+            if (last_pts >= clip.end_pts) {
+                finish_clip();
+            }
+        }
+
+        if (preroll.empty() && !keyframe) {
+            return;
+        }
+        preroll.push_back(gst_buffer_ref(buffer));
+        preroll_bytes += gst_buffer_get_size(buffer);
+        trim_preroll();
+    }
+
+    // Starts (or extends) a clip and returns its file name, or an empty
+    // string if there is nothing buffered yet.
+    std::string trigger(GstClockTime post_roll = GST_CLOCK_TIME_NONE) {
+        if (post_roll == GST_CLOCK_TIME_NONE) {
+            post_roll = settings.post_roll;
+        }
+
+        GstCaps *clip_caps;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (clip.pipeline) {
+                clip.end_pts = std::max(clip.end_pts, last_pts + post_roll);
+                return clip.filename;
+            }
+            if (preroll.empty() || !caps) {
+                return "";
+            }
+            clip_caps = gst_caps_ref(caps);
+        }
+
+        // Building and starting the pipeline takes a while, and push() runs
+        // on the encoder's thread: do it without the lock.
+        Clip next;
+        next.filename = generate_filename(settings.prefix + "_event", true);
+        std::ostringstream launch;
+        launch << "appsrc name=src format=time ! h264parse ! mp4mux ! filesink location=" << next.filename;
+        GError *error = nullptr;
+        next.pipeline = gst_parse_launch(launch.str().c_str(), &error);
+        if (!next.pipeline) {
+            g_printerr("Failed to create event clip: %s\n", error ? error->message : "unknown error");
+            g_clear_error(&error);
+            gst_caps_unref(clip_caps);
+            return "";
+        }
+        next.src = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(next.pipeline), "src"));
+        gst_app_src_set_caps(next.src, clip_caps);
+        gst_caps_unref(clip_caps);
+        g_object_set(next.src, "max-bytes", (guint64)0, NULL);
+        gst_element_set_state(next.pipeline, GST_STATE_PLAYING);
+
+        std::string filename;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (clip.pipeline || preroll.empty()) {
+                // Another trigger got there first.
+                if (clip.pipeline) {
+                    clip.end_pts = std::max(clip.end_pts, last_pts + post_roll);
+                }
+                filename = clip.filename;
+            } else {
+                clip = next;
+                clip.base_pts = GST_BUFFER_PTS(preroll.front());
+                clip.end_pts = last_pts + post_roll;
+                for (GstBuffer *buffer : preroll) {
+                    push_to_clip(buffer);
+                }
+                g_print("Recording event to file: %s\n", clip.filename.c_str());
+                return clip.filename;
+            }
+        }
+        gst_element_set_state(next.pipeline, GST_STATE_NULL);
+        gst_object_unref(next.src);
+        gst_object_unref(next.pipeline);
+        unlink(next.filename.c_str());
+        return filename;
+    }
+
+private:
+    struct Clip {
+        GstElement *pipeline = nullptr;
+        GstAppSrc *src = nullptr;
+        GstClockTime base_pts = 0;
+        GstClockTime end_pts = 0;
+        std::string filename;
+    };
+
+    // Metadata-only copy, rebased so the clip starts at zero.
+    void push_to_clip(GstBuffer *buffer) {
+        GstBuffer *copy = gst_buffer_copy(buffer);
+        if (GST_BUFFER_PTS_IS_VALID(copy)) {
+            GST_BUFFER_PTS(copy) -= std::min(GST_BUFFER_PTS(copy), clip.base_pts);
+        }
+        if (GST_BUFFER_DTS(copy) != GST_CLOCK_TIME_NONE) {
+            GST_BUFFER_DTS(copy) -= std::min(GST_BUFFER_DTS(copy), clip.base_pts);
+        }
+        gst_app_src_push_buffer(clip.src, copy);
+    }
+
+    // Hands the clip to the finalizer thread, which waits for mp4mux to
+    // write the moov, so the encoder thread never blocks on the file.
+    // Called with the mutex held.
+    void finish_clip() {
+        gst_app_src_end_of_stream(clip.src);
+        to_finalize.push_back(clip);
+        clip = Clip();
+        finished.notify_one();
+    }
+
+    void finalize_clips() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            finished.wait(lock, [this] { return stopping || !to_finalize.empty(); });
+            if (to_finalize.empty()) {
+                return;
+            }
+            Clip done = to_finalize.front();
+            to_finalize.pop_front();
+            lock.unlock();
+
+            GstBus *bus = gst_element_get_bus(done.pipeline);
+            GstMessage *msg = gst_bus_timed_pop_filtered(bus, 10 * GST_SECOND,
+                                                         (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+            if (msg) {
+                gst_message_unref(msg);
+            }
+            gst_object_unref(bus);
+            gst_element_set_state(done.pipeline, GST_STATE_NULL);
+            gst_object_unref(done.src);
+            gst_object_unref(done.pipeline);
+            g_print("Event saved: %s\n", done.filename.c_str());
+
+            lock.lock();
+        }
+    }
+
+    // Drops whole GOPs from the front so the ring always starts on a
+    // keyframe and stays within both the time and the memory budget.
+    void trim_preroll() {
+        while (!preroll.empty() &&
+               (last_pts - GST_BUFFER_PTS(preroll.front()) > settings.pre_roll ||
+                preroll_bytes > settings.max_bytes)) {
+            do {
+                preroll_bytes -= gst_buffer_get_size(preroll.front());
+                gst_buffer_unref(preroll.front());
+                preroll.pop_front();
+            } while (!preroll.empty() && GST_BUFFER_FLAG_IS_SET(preroll.front(), GST_BUFFER_FLAG_DELTA_UNIT));
+        }
+    }
+
+    void clear_preroll() {
+        for (GstBuffer *buffer : preroll) {
+            gst_buffer_unref(buffer);
+        }
+        preroll.clear();
+        preroll_bytes = 0;
+    }
+
+    EventSettings settings;
+    std::mutex mutex;
+    std::deque<GstBuffer *> preroll;
+    size_t preroll_bytes = 0;
+    GstCaps *caps = nullptr;
+    GstClockTime last_pts = 0;
+    Clip clip;
+    std::deque<Clip> to_finalize;               // finished, waiting for their moov
+    std::condition_variable finished;
+    bool stopping = false;
+    std::thread finalizer;                      // last: started once the rest exists
+};
+
+#endif // EVENT_RECORDER_H
@@ -0,0 +1,270 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <opencv2/opencv.hpp>
+#include <gst/gst.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+
+// One recycled capture buffer. The capture thread reads the camera straight
+// into `bgr` and converts once into `i420`, whose memory is handed to appsrc
+// without copying (see FrameRing::wrap).
+//
+// With native capture there is no BGR frame: attach() maps the capture
+// pipeline's own buffer and points `i420` at it, so the frame reaches the
+// encoder without any copy. `i420` then holds whatever 4:2:0 layout the
+// capture produced (I420 or NV12); both start with the full Y plane.
+//
+// `refs` counts readers. The producer claims a slot by swapping 0 for
+// WRITING, so a slot a consumer still holds is never overwritten.
+struct FrameSlot {
+    static constexpr int WRITING = -1;
+
+    cv::Mat bgr;
+    cv::Mat i420;
+    std::atomic<int> refs{0};
+    std::atomic<uint64_t> seq{0};
+    GstClockTime capture_time = GST_CLOCK_TIME_NONE;   // encoder running time
+
+    FrameSlot(int width, int height)
+        : bgr(height, width, CV_8UC3),
+          i420(height * 3 / 2, width, CV_8UC1),
+          storage(i420) {}
+
+    ~FrameSlot() {
+        detach();
+    }
+
+    size_t i420_size() const { return i420.total() * i420.elemSize(); }
+
+    // Keeps a reference on `buffer` and maps it as this slot's frame until
+    // the slot is written again. Fails if the buffer is not a tightly
+    // packed frame of the slot's size.
+    bool attach(GstBuffer *buffer) {
+        detach();
+        if (gst_buffer_get_size(buffer) != storage.total() ||
+            !gst_buffer_map(buffer, &external_map, GST_MAP_READ)) {
+            return false;
+        }
+        external = gst_buffer_ref(buffer);
+        i420 = cv::Mat(storage.rows, storage.cols, CV_8UC1, external_map.data);
+        return true;
+    }
+
+    // Drops the attached buffer, if any, and goes back to the slot's own memory.
+    void detach() {
+        if (external) {
+            gst_buffer_unmap(external, &external_map);
+            gst_buffer_unref(external);
+            external = nullptr;
+            i420 = storage;
+        }
+    }
+
+private:
+    cv::Mat storage;
+    GstBuffer *external = nullptr;
+    GstMapInfo external_map;
+};
+
+class FrameConsumer;
+
+// Single-producer, multi-consumer ring of frame slots. The capture thread
+// publishes into a free slot and every consumer independently picks up the
+// newest one, so neither the producer nor the other consumers ever wait on a
+// slow reader. The only lock is taken by consumers that want to sleep.
+class FrameRing {
+public:
+    FrameRing(int width, int height, size_t n_slots = 6) {
+        for (size_t i = 0; i < n_slots; ++i) {
+            slots.emplace_back(new FrameSlot(width, height));
+        }
+    }
+
+    // Returns a slot no consumer references, or nullptr if every slot is
+    // still held downstream (the caller should drop the frame).
+    FrameSlot *begin_write() {
+        FrameSlot *newest = latest.load(std::memory_order_acquire);
+        for (size_t i = 0; i < slots.size(); ++i) {
+            FrameSlot *slot = slots[next_slot].get();
+            next_slot = (next_slot + 1) % slots.size();
+            int expected = 0;
+            if (slot != newest && slot->refs.compare_exchange_strong(expected, FrameSlot::WRITING)) {
+                slot->detach();
+                return slot;
+            }
+        }
+        producer_drops.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // Makes `slot` the newest frame and wakes sleeping consumers.
+    void publish(FrameSlot *slot) {
+        uint64_t seq = published.load(std::memory_order_relaxed) + 1;
+        slot->seq.store(seq, std::memory_order_relaxed);
+        slot->refs.store(0, std::memory_order_release);
+        latest.store(slot, std::memory_order_release);
+        published.store(seq, std::memory_order_release);
+
+        if (waiters.load(std::memory_order_acquire) > 0) {
+            std::lock_guard<std::mutex> lock(wait_mutex);
+            wait_cv.notify_all();
+        }
+    }
+
+    // Gives a writer slot back without publishing it (e.g. capture failed).
+    void abort_write(FrameSlot *slot) {
+        slot->refs.store(0, std::memory_order_release);
+    }
+
+    // Takes a reference on the newest frame, or returns nullptr if nothing
+    // was published yet. Drop the reference with release().
+    FrameSlot *acquire_latest() {
+        for (;;) {
+            FrameSlot *slot = latest.load(std::memory_order_acquire);
+            if (!slot) {
+                return nullptr;
+            }
+            int refs = slot->refs.load(std::memory_order_acquire);
+            if (refs == FrameSlot::WRITING) {
+                // The slot was recycled after we loaded it; look again.
+                continue;
+            }
+            if (slot->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_acq_rel)) {
+                return slot;
+            }
+        }
+    }
+
+    // Sleeps until a frame newer than `seq` is published or `timeout` passes.
+    bool wait_newer(uint64_t seq, std::chrono::milliseconds timeout) {
+        if (published.load(std::memory_order_acquire) > seq) {
+            return true;
+        }
+        std::unique_lock<std::mutex> lock(wait_mutex);
+        waiters.fetch_add(1, std::memory_order_acq_rel);
+        bool ready = wait_cv.wait_for(lock, timeout, [&] {
+            return published.load(std::memory_order_acquire) > seq;
+        });
+        waiters.fetch_sub(1, std::memory_order_acq_rel);
+        return ready;
+    }
+
+    static void release(gpointer data) {
+        static_cast<FrameSlot *>(data)->refs.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    // Wraps the slot's I420 plane in a GstBuffer without copying. The buffer
+    // owns one reference on the slot and drops it when GStreamer frees it.
+    static GstBuffer *wrap(FrameSlot *slot) {
+        return gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,
+                                           slot->i420.data, slot->i420_size(),
+                                           0, slot->i420_size(),
+                                           slot, FrameRing::release);
+    }
+
+    uint64_t published_frames() const { return published.load(std::memory_order_relaxed); }
+    uint64_t dropped_frames() const { return producer_drops.load(std::memory_order_relaxed); }
+
+    void add_consumer(FrameConsumer *consumer) {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        consumers.push_back(consumer);
+    }
+
+    void remove_consumer(FrameConsumer *consumer) {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        for (auto it = consumers.begin(); it != consumers.end(); ++it) {
+            if (*it == consumer) {
+                consumers.erase(it);
+                break;
+            }
+        }
+    }
+
+    inline void print_stats();
+
+private:
+    std::vector<std::unique_ptr<FrameSlot>> slots;
+    size_t next_slot = 0;                       // producer only
+    std::atomic<FrameSlot *> latest{nullptr};
+    std::atomic<uint64_t> published{0};
+    std::atomic<uint64_t> producer_drops{0};
+
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+    std::atomic<int> waiters{0};
+    std::vector<FrameConsumer *> consumers;
+};
+
+// A reader's cursor into the ring. Each consumer remembers the last sequence
+// number it saw, so frames it never picked up are counted as dropped and
+// frames it picked up twice are counted as repeated.
+class FrameConsumer {
+public:
+    FrameConsumer(FrameRing &ring, const std::string &name) : ring(ring), name(name) {
+        ring.add_consumer(this);
+    }
+
+    ~FrameConsumer() {
+        ring.remove_consumer(this);
+    }
+
+    // Newest frame, even if this consumer already saw it.
+    FrameSlot *latest() {
+        FrameSlot *slot = ring.acquire_latest();
+        if (slot) {
+            account(slot->seq.load(std::memory_order_relaxed));
+        }
+        return slot;
+    }
+
+    // Newest frame not seen yet; waits up to `timeout` for one to arrive.
+    FrameSlot *next(std::chrono::milliseconds timeout) {
+        if (!ring.wait_newer(last_seq, timeout)) {
+            return nullptr;
+        }
+        return latest();
+    }
+
+    uint64_t dropped() const { return dropped_frames.load(std::memory_order_relaxed); }
+    uint64_t repeated() const { return repeated_frames.load(std::memory_order_relaxed); }
+    uint64_t consumed() const { return consumed_frames.load(std::memory_order_relaxed); }
+    const std::string &get_name() const { return name; }
+
+private:
+    void account(uint64_t seq) {
+        if (seq == last_seq) {
+            repeated_frames.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (last_seq != 0 && seq > last_seq + 1) {
+            dropped_frames.fetch_add(seq - last_seq - 1, std::memory_order_relaxed);
+        }
+        consumed_frames.fetch_add(1, std::memory_order_relaxed);
+        last_seq = seq;
+    }
+
+    FrameRing &ring;
+    std::string name;
+    uint64_t last_seq = 0;
+    std::atomic<uint64_t> consumed_frames{0};
+    std::atomic<uint64_t> dropped_frames{0};
+    std::atomic<uint64_t> repeated_frames{0};
+};
+
+inline void FrameRing::print_stats() {
+    std::lock_guard<std::mutex> lock(wait_mutex);
+    g_print("Frames published: %" G_GUINT64_FORMAT ", dropped at capture: %" G_GUINT64_FORMAT "\n",
+            published_frames(), dropped_frames());
+    for (FrameConsumer *consumer : consumers) {
+        g_print("  %s: consumed %" G_GUINT64_FORMAT ", dropped %" G_GUINT64_FORMAT ", repeated %" G_GUINT64_FORMAT "\n",
+                consumer->get_name().c_str(), consumer->consumed(), consumer->dropped(), consumer->repeated());
+    }
+}
+
+#endif // FRAME_RING_H
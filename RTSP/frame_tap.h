@@ -0,0 +1,551 @@
+#ifndef FRAME_TAP_H
+#define FRAME_TAP_H
+
+#include <opencv2/opencv.hpp>
+#include <gst/gst.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "frame_ring.h"
+
+struct TapSettings {
+    bool enabled = false;
+    double scale = 0.5;      // tap frame size relative to the capture size
+    int fps = 5;             // most frames per second written to the tap
+};
+
+// Shared memory layout of a tap. Everything is little endian and the
+// pixels are BGR24, what the analytics side hands to its model.
+//
+//   TapHeader                       at 0, header_size bytes
+//   slot i: TapSlotHeader + pixels  at header_size + i * slot_size
+//
+// Frame n (n >= 1) goes to slot n % slot_count. A reader loads `latest`,
+// checks the slot's `seq` equals it, copies the pixels and checks `seq`
+// again; a changed seq means the writer lapped it and the copy is retried.
+struct TapHeader {
+    char magic[8];                   // "WBCTAP1"
+    uint32_t header_size;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t fps;
+    uint32_t reserved;
+    std::atomic<uint64_t> latest;    // seq of the newest complete frame, 0 for none
+    uint8_t padding[16];
+};
+
+struct TapSlotHeader {
+    std::atomic<uint64_t> seq;       // 0 while the slot is being written
+    uint64_t capture_time;           // ns of server running time
+    uint64_t padding[6];
+};
+
+static_assert(sizeof(TapHeader) == 64 && sizeof(TapSlotHeader) == 64, "tap headers are part of the ABI");
+
+// A frame ring consumer that copies downscaled BGR frames into a memfd, at
+// most `fps` times per second. Local readers map that memfd read-only and
+// are woken through their own eventfd, so getting pixels for detection
+// costs one scale per tap frame instead of an RTSP decode per stream frame.
+class FrameTap {
+public:
+    static constexpr uint32_t SLOTS = 4;
+
+    // `yuv_format` is the layout of FrameSlot::i420 ("I420" or "NV12"); an
+    // empty one means the slots carry a BGR frame to scale directly.
+    FrameTap(FrameRing &ring, const std::string &name, int width, int height,
+             const std::string &yuv_format, const TapSettings &settings)
+        : name(name), consumer(ring, name + "/tap"),
+          capture_width(width), capture_height(height), yuv_format(yuv_format), settings(settings) {
+        tap_width = std::max(2, (int)(width * settings.scale) & ~1);
+        tap_height = std::max(2, (int)(height * settings.scale) & ~1);
+        stride = tap_width * 3;
+        slot_size = sizeof(TapSlotHeader) + (((size_t)stride * tap_height + 63) & ~(size_t)63);
+        map_size = sizeof(TapHeader) + SLOTS * slot_size;
+    }
+
+    ~FrameTap() {
+        stop();
+    }
+
+    bool start() {
+        memory_fd = memfd_create(("wbcam-" + name).c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (memory_fd < 0 || ftruncate(memory_fd, map_size) < 0) {
+            perror("memfd");
+            return false;
+        }
+        fcntl(memory_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+        // Readers get a descriptor opened read-only, so they cannot map the
+        // tap writable even by mistake.
+        readonly_fd = open(("/proc/self/fd/" + std::to_string(memory_fd)).c_str(), O_RDONLY | O_CLOEXEC);
+        map = static_cast<uint8_t *>(mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0));
+        if (readonly_fd < 0 || map == MAP_FAILED) {
+            perror("mmap");
+            map = nullptr;
+            return false;
+        }
+
+        TapHeader *header = new (map) TapHeader();
+        memcpy(header->magic, "WBCTAP1", 8);
+        header->header_size = sizeof(TapHeader);
+        header->slot_count = SLOTS;
+        header->slot_size = slot_size;
+        header->width = tap_width;
+        header->height = tap_height;
+        header->stride = stride;
+        header->fps = settings.fps;
+        header->latest.store(0, std::memory_order_release);
+        for (uint32_t i = 0; i < SLOTS; ++i) {
+            new (slot_header(i)) TapSlotHeader();
+        }
+
+        running = true;
+        thread = std::thread(&FrameTap::run, this);
+        g_print("[%s] frame tap %dx%d BGR at up to %d fps\n", name.c_str(), tap_width, tap_height, settings.fps);
+        return true;
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (map) {
+            munmap(map, map_size);
+            map = nullptr;
+        }
+        for (int fd : {memory_fd, readonly_fd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        memory_fd = readonly_fd = -1;
+        std::lock_guard<std::mutex> lock(listener_mutex);
+        for (int fd : listeners) {
+            close(fd);
+        }
+        listeners.clear();
+    }
+
+    // The reply line a reader gets along with readonly_fd() and its eventfd.
+    std::string describe() const {
+        std::ostringstream line;
+        line << "OK " << tap_width << " " << tap_height << " " << stride << " "
+             << SLOTS << " " << slot_size << " " << sizeof(TapHeader);
+        return line.str();
+    }
+
+    int shared_fd() const { return readonly_fd; }
+
+    // Creates an eventfd that is signalled for every frame written from now
+    // on. The tap owns it; drop it with remove_listener().
+    int add_listener() {
+        int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fd >= 0) {
+            std::lock_guard<std::mutex> lock(listener_mutex);
+            listeners.push_back(fd);
+        }
+        return fd;
+    }
+
+    void remove_listener(int fd) {
+        std::lock_guard<std::mutex> lock(listener_mutex);
+        auto it = std::find(listeners.begin(), listeners.end(), fd);
+        if (it != listeners.end()) {
+            close(fd);
+            listeners.erase(it);
+        }
+    }
+
+private:
+    TapSlotHeader *slot_header(uint32_t index) {
+        return reinterpret_cast<TapSlotHeader *>(map + sizeof(TapHeader) + index * slot_size);
+    }
+
+    void run() {
+        const GstClockTime period = gst_util_uint64_scale_int(1, GST_SECOND, std::max(settings.fps, 1));
+        GstClockTime last_written = GST_CLOCK_TIME_NONE;
+        while (running) {
+            FrameSlot *slot = consumer.next(std::chrono::milliseconds(200));
+            if (!slot) {
+                continue;
+            }
+            GstClockTime time = slot->capture_time;
+            if (last_written == GST_CLOCK_TIME_NONE || time - last_written >= period) {
+                write(slot);
+                last_written = time;
+            }
+            FrameRing::release(slot);
+        }
+    }
+
+    void write(FrameSlot *frame) {
+        uint64_t seq = ++written;
+        TapSlotHeader *slot = slot_header(seq % SLOTS);
+        slot->seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        cv::Mat out(tap_height, tap_width, CV_8UC3, reinterpret_cast<uint8_t *>(slot + 1), stride);
+        if (yuv_format.empty()) {
+            cv::resize(frame->bgr, out, out.size(), 0, 0, cv::INTER_AREA);
+        } else {
+            cv::Mat yuv(capture_height * 3 / 2, capture_width, CV_8UC1, frame->i420.data);
+            cv::cvtColor(yuv, bgr, yuv_format == "NV12" ? cv::COLOR_YUV2BGR_NV12 : cv::COLOR_YUV2BGR_I420);
+            cv::resize(bgr, out, out.size(), 0, 0, cv::INTER_AREA);
+        }
+        slot->capture_time = frame->capture_time;
+        slot->seq.store(seq, std::memory_order_release);
+        reinterpret_cast<TapHeader *>(map)->latest.store(seq, std::memory_order_release);
+
+        const uint64_t one = 1;
+        std::lock_guard<std::mutex> lock(listener_mutex);
+        for (int fd : listeners) {
+            // EAGAIN only means the reader is behind; it reads `latest` anyway.
+            ssize_t sent = ::write(fd, &one, sizeof(one));
+            (void)sent;
+        }
+    }
+
+    std::string name;
+    FrameConsumer consumer;
+    int capture_width;
+    int capture_height;
+    std::string yuv_format;
+    TapSettings settings;
+    int tap_width;
+    int tap_height;
+    uint32_t stride;
+    uint32_t slot_size;
+    size_t map_size;
+
+    int memory_fd = -1;
+    int readonly_fd = -1;
+    uint8_t *map = nullptr;
+    cv::Mat bgr;                     // full size conversion of YUV slots
+    uint64_t written = 0;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    std::mutex listener_mutex;
+    std::vector<int> listeners;
+};
+
+// Hands taps to local readers over a UNIX stream socket:
+//
+//   TAP <camera>\n  ->  OK <width> <height> <stride> <slots> <slot_size> <header_size>\n
+//                       with SCM_RIGHTS [read-only memfd, eventfd]
+//                   ->  ERR <reason>\n
+//
+// The connection stays open for as long as the reader wants notifications;
+// closing it releases its eventfd.
+class TapServer {
+public:
+    using Lookup = std::function<FrameTap *(const std::string &camera)>;
+
+    ~TapServer() {
+        stop();
+    }
+
+    bool start(const std::string &path, Lookup lookup) {
+        this->path = path;
+        this->lookup = lookup;
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            perror("socket");
+            return false;
+        }
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str());
+
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+            perror("bind");
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        running = true;
+        thread = std::thread(&TapServer::serve, this);
+        g_print("Frame taps on %s\n", path.c_str());
+        return true;
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+        for (Reader &reader : readers) {
+            drop(reader);
+        }
+        readers.clear();
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            unlink(path.c_str());
+            listen_fd = -1;
+        }
+    }
+
+private:
+    struct Reader {
+        int socket;
+        FrameTap *tap;
+        int event_fd;
+        std::string pending;
+    };
+
+    void serve() {
+        while (running) {
+            std::vector<struct pollfd> fds = {{listen_fd, POLLIN, 0}};
+            for (const Reader &reader : readers) {
+                fds.push_back({reader.socket, POLLIN, 0});
+            }
+            if (poll(fds.data(), fds.size(), 500) <= 0) {
+                continue;
+            }
+
+            // Walk backwards so erasing a reader keeps the other indexes valid.
+            for (size_t i = fds.size() - 1; i > 0; --i) {
+                if (fds[i].revents && !handle_reader(readers[i - 1])) {
+                    drop(readers[i - 1]);
+                    readers.erase(readers.begin() + (i - 1));
+                }
+            }
+            if (fds[0].revents & POLLIN) {
+                int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (client >= 0) {
+                    readers.push_back({client, nullptr, -1, ""});
+                }
+            }
+        }
+    }
+
+    // Returns false once the reader should be dropped.
+    bool handle_reader(Reader &reader) {
+        char buffer[256];
+        ssize_t n = read(reader.socket, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return false;
+        }
+        if (reader.tap) {
+            return true;    // nothing more to say after the handshake
+        }
+        reader.pending.append(buffer, n);
+        size_t end = reader.pending.find('\n');
+        if (end == std::string::npos) {
+            return reader.pending.size() < 1024;
+        }
+
+        std::istringstream fields(reader.pending.substr(0, end));
+        std::string command, camera;
+        fields >> command >> camera;
+        FrameTap *tap = command == "TAP" ? lookup(camera) : nullptr;
+        if (!tap) {
+            std::string reply = command == "TAP" ? "ERR no tap for " + camera + "\n" : "ERR expected TAP <camera>\n";
+            ssize_t sent = write(reader.socket, reply.data(), reply.size());
+            (void)sent;
+            return false;
+        }
+
+        reader.tap = tap;
+        reader.event_fd = tap->add_listener();
+        return reader.event_fd >= 0 && send_fds(reader.socket, tap->describe() + "\n", tap->shared_fd(), reader.event_fd);
+    }
+
+    static bool send_fds(int socket, const std::string &line, int memory_fd, int event_fd) {
+        struct iovec iov = {const_cast<char *>(line.data()), line.size()};
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        memset(control, 0, sizeof(control));
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        int fds[2] = {memory_fd, event_fd};
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        return sendmsg(socket, &msg, MSG_NOSIGNAL) == (ssize_t)line.size();
+    }
+
+    void drop(Reader &reader) {
+        if (reader.tap) {
+            reader.tap->remove_listener(reader.event_fd);
+        }
+        close(reader.socket);
+    }
+
+    std::string path;
+    Lookup lookup;
+    int listen_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+    std::vector<Reader> readers;     // serve() thread only
+};
+
+// The reading side of a tap, for local analytics written in C++ (frame_tap.py
+// is the Python one). Poll event_fd() for readability, then read_latest().
+class TapReader {
+public:
+    ~TapReader() {
+        close();
+    }
+
+    bool open(const std::string &path, const std::string &camera) {
+        socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (socket_fd < 0 || connect(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            close();
+            return false;
+        }
+
+        std::string request = "TAP " + camera + "\n";
+        if (write(socket_fd, request.data(), request.size()) != (ssize_t)request.size()) {
+            close();
+            return false;
+        }
+
+        char reply[256] = {0};
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        struct iovec iov = {reply, sizeof(reply) - 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+
+        int fds[2] = {-1, -1};
+        struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if (cmsg && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+        event_fd = fds[1];
+
+        std::istringstream fields(reply);
+        std::string status;
+        fields >> status >> width >> height >> stride >> slot_count >> slot_size >> header_size;
+        if (status != "OK" || fds[0] < 0) {
+            std::cerr << "Error: frame tap for " << camera << ": " << reply << std::endl;
+            if (fds[0] >= 0) {
+                ::close(fds[0]);
+            }
+            close();
+            return false;
+        }
+
+        map_size = header_size + (size_t)slot_count * slot_size;
+        void *mapping = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fds[0], 0);
+        ::close(fds[0]);
+        if (mapping == MAP_FAILED) {
+            perror("mmap");
+            close();
+            return false;
+        }
+        map = static_cast<const uint8_t *>(mapping);
+        return true;
+    }
+
+    int get_event_fd() const { return event_fd; }
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+
+    // Copies the newest frame not read yet into `frame` (allocated as
+    // needed); returns false if there is none.
+    bool read_latest(cv::Mat &frame, GstClockTime *capture_time = nullptr) {
+        // One read resets the eventfd counter, however many frames it counted.
+        uint64_t pending;
+        ssize_t drained = read(event_fd, &pending, sizeof(pending));
+        (void)drained;
+
+        const TapHeader *header = reinterpret_cast<const TapHeader *>(map);
+        for (;;) {
+            uint64_t seq = header->latest.load(std::memory_order_acquire);
+            if (seq == 0 || seq == last_seq) {
+                return false;
+            }
+            const TapSlotHeader *slot =
+                reinterpret_cast<const TapSlotHeader *>(map + header_size + (seq % slot_count) * slot_size);
+            if (slot->seq.load(std::memory_order_acquire) != seq) {
+                continue;
+            }
+            frame.create(height, width, CV_8UC3);
+            const uint8_t *pixels = reinterpret_cast<const uint8_t *>(slot + 1);
+            for (int row = 0; row < height; ++row) {
+                memcpy(frame.ptr(row), pixels + (size_t)row * stride, (size_t)width * 3);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot->seq.load(std::memory_order_relaxed) != seq) {
+                continue;    // lapped by the writer while copying
+            }
+            if (capture_time) {
+                *capture_time = slot->capture_time;
+            }
+            last_seq = seq;
+            return true;
+        }
+    }
+
+    void close() {
+        if (map) {
+            munmap(const_cast<uint8_t *>(map), map_size);
+            map = nullptr;
+        }
+        for (int *fd : {&event_fd, &socket_fd}) {
+            if (*fd >= 0) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+private:
+    int socket_fd = -1;
+    int event_fd = -1;
+    const uint8_t *map = nullptr;
+    size_t map_size = 0;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0;
+    uint32_t slot_count = 0;
+    size_t slot_size = 0;
+    size_t header_size = 0;
+    uint64_t last_seq = 0;
+};
+
+#endif // FRAME_TAP_H
@@ -0,0 +1,76 @@
+import mmap
+import os
+import select
+import socket
+import struct
+
+import numpy as np
+
+# Reader for wbcam_server's shared memory frame tap (wbcam_server --tap).
+# The server passes a read-only memfd and an eventfd over a UNIX socket; the
+# frames are already downscaled BGR, so there is nothing to decode.
+#
+#   tap = FrameTap("cam0")
+#   ok, frame = tap.read()        # blocks until the next frame
+#
+# Layout and protocol are described in frame_tap.h.
+
+HEADER = struct.Struct("<8s8IQ")
+SLOT_HEADER = struct.Struct("<QQ")
+
+
+class FrameTap:
+    def __init__(self, camera, socket_path="/tmp/wbcam_tap.sock"):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(socket_path)
+        self.sock.sendall(f"TAP {camera}\n".encode("utf-8"))
+        reply, fds, _, _ = socket.recv_fds(self.sock, 256, 2)
+        fields = reply.decode("utf-8").split()
+        if not fields or fields[0] != "OK" or len(fds) != 2:
+            for fd in fds:
+                os.close(fd)
+            self.sock.close()
+            raise OSError(f"frame tap for {camera}: {reply.decode('utf-8').strip()}")
+
+        self.width, self.height, self.stride, self.slots, self.slot_size, self.header_size = map(int, fields[1:7])
+        memory_fd, self.event_fd = fds
+        self.map = mmap.mmap(memory_fd, self.header_size + self.slots * self.slot_size,
+                             mmap.MAP_SHARED, mmap.PROT_READ)
+        os.close(memory_fd)
+        self.last_seq = 0
+        self.capture_time = 0
+
+    def _latest(self):
+        return HEADER.unpack_from(self.map, 0)[-1]
+
+    def _copy(self, seq):
+        offset = self.header_size + (seq % self.slots) * self.slot_size
+        if SLOT_HEADER.unpack_from(self.map, offset)[0] != seq:
+            return None
+        pixels = offset + 64
+        frame = np.frombuffer(self.map, np.uint8, self.stride * self.height, pixels).copy()
+        slot_seq, capture_time = SLOT_HEADER.unpack_from(self.map, offset)
+        if slot_seq != seq:
+            return None  # overwritten while copying
+        self.capture_time = capture_time
+        return frame.reshape(self.height, self.stride)[:, :self.width * 3].reshape(self.height, self.width, 3)
+
+    def read(self, timeout=1.0):
+        """Returns (True, frame) with the newest frame not returned yet, or
+        (False, None) if none arrives within `timeout` seconds."""
+        while True:
+            seq = self._latest()
+            if seq != self.last_seq and seq != 0:
+                frame = self._copy(seq)
+                if frame is not None:
+                    self.last_seq = seq
+                    return True, frame
+                continue
+            if not select.select([self.event_fd], [], [], timeout)[0]:
+                return False, None
+            os.read(self.event_fd, 8)
+
+    def close(self):
+        self.map.close()
+        os.close(self.event_fd)
+        self.sock.close()
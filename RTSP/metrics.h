@@ -0,0 +1,328 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <gst/gst.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counters and latency histograms for sizing a box: how long each stage of
+// a camera's path takes and how many frames made it through. Recording is a
+// few relaxed atomic adds and never takes a lock, so it is safe on the
+// capture and streaming threads. Everything registered is served in the
+// Prometheus text format by MetricsServer.
+namespace metrics {
+
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear buckets in the style of HdrHistogram: every power of two is
+// split into 16 linear sub-buckets, so any nanosecond value lands in a
+// bucket within about 6 % of it, from 1 ns to centuries, in 976 counters.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUB = 1 << SUB_BITS;
+    static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    void record(uint64_t ns) {
+        counts[index(ns)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // Records the time since `start_ns` (a now_ns() value).
+    void record_since(uint64_t start_ns) {
+        uint64_t now = now_ns();
+        record(now > start_ns ? now - start_ns : 0);
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_ns.load(std::memory_order_relaxed); }
+
+    // Midpoint of the bucket holding the q-th value, 0 <= q <= 1. Racing
+    // writers only make the answer a few samples stale.
+    uint64_t quantile(double q) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q * n + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return lower_bound(i) + bucket_width(i) / 2;
+            }
+        }
+        return lower_bound(BUCKETS - 1);
+    }
+
+    static int index(uint64_t value) {
+        if (value < (uint64_t)SUB) {
+            return (int)value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        return (exponent - SUB_BITS + 1) * SUB + (int)((value >> (exponent - SUB_BITS)) & (SUB - 1));
+    }
+
+private:
+    static uint64_t lower_bound(int i) {
+        if (i < 2 * SUB) {
+            return i;
+        }
+        int exponent = i / SUB + SUB_BITS - 1;
+        return (uint64_t)(SUB + i % SUB) << (exponent - SUB_BITS);
+    }
+
+    static uint64_t bucket_width(int i) {
+        return i < 2 * SUB ? 1 : (uint64_t)1 << (i / SUB - 1);
+    }
+
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum_ns{0};
+};
+
+class Counter {
+public:
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Owns every metric. Registering takes a lock and is meant for setup;
+// callbacks registered with expose() are only called while rendering, under
+// the same lock, so whoever owns what they read removes them with unexpose()
+// before it goes away.
+class Registry {
+public:
+    static Registry &global() {
+        static Registry registry;
+        return registry;
+    }
+
+    // `labels` is the Prometheus label list without braces, e.g.
+    // camera="cam0",stage="capture".
+    Histogram &histogram(const std::string &name, const std::string &help, const std::string &labels) {
+        std::lock_guard<std::mutex> lock(mutex);
+        histograms.emplace_back(new Histogram());
+        Histogram *histogram = histograms.back().get();
+        add(name, help, "summary", labels, [histogram](std::ostream &out, const std::string &name, const std::string &labels) {
+            static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+            std::string prefix = labels.empty() ? "" : labels + ",";
+            for (double q : quantiles) {
+                out << name << "{" << prefix << "quantile=\"" << q << "\"} " << histogram->quantile(q) / 1e9 << "\n";
+            }
+            out << name << "_sum" << braces(labels) << " " << histogram->sum() / 1e9 << "\n"
+                << name << "_count" << braces(labels) << " " << histogram->count() << "\n";
+        });
+        return *histogram;
+    }
+
+    Counter &counter(const std::string &name, const std::string &help, const std::string &labels) {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.emplace_back(new Counter());
+        Counter *counter = counters.back().get();
+        add(name, help, "counter", labels, [counter](std::ostream &out, const std::string &name, const std::string &labels) {
+            out << name << braces(labels) << " " << counter->get() << "\n";
+        });
+        return *counter;
+    }
+
+    // A value kept elsewhere; `type` is "counter" or "gauge". The id is for
+    // unexpose().
+    uint64_t expose(const std::string &name, const std::string &help, const std::string &type,
+                    const std::string &labels, std::function<double()> read) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t id = ++last_id;
+        add(name, help, type, labels, [read](std::ostream &out, const std::string &name, const std::string &labels) {
+            out << name << braces(labels) << " " << read() << "\n";
+        }, id);
+        return id;
+    }
+
+    // Stops rendering an exposed value; once it returns, its callback is not
+    // running and will not be called again.
+    void unexpose(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto family = families.begin(); family != families.end();) {
+            auto &series = family->second.series;
+            series.erase(std::remove_if(series.begin(), series.end(), [id](const Series &s) { return s.id == id; }),
+                         series.end());
+            family = series.empty() ? families.erase(family) : std::next(family);
+        }
+    }
+
+    // The exposition text, one block per metric name.
+    std::string render() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        for (auto &family : families) {
+            out << "# HELP " << family.first << " " << family.second.help << "\n"
+                << "# TYPE " << family.first << " " << family.second.type << "\n";
+            for (auto &series : family.second.series) {
+                series.writer(out, family.first, series.labels);
+            }
+        }
+        return out.str();
+    }
+
+private:
+    using Writer = std::function<void(std::ostream &, const std::string &, const std::string &)>;
+
+    struct Series {
+        std::string labels;
+        Writer writer;
+        uint64_t id;                    // from expose(); 0 for metrics the registry owns
+    };
+
+    struct Family {
+        std::string help;
+        std::string type;
+        std::vector<Series> series;
+    };
+
+    void add(const std::string &name, const std::string &help, const std::string &type,
+             const std::string &labels, Writer writer, uint64_t id = 0) {
+        Family &family = families[name];
+        family.help = help;
+        family.type = type;
+        family.series.push_back({labels, writer, id});
+    }
+
+    static std::string braces(const std::string &labels) {
+        return labels.empty() ? "" : "{" + labels + "}";
+    }
+
+    std::mutex mutex;
+    std::map<std::string, Family> families;
+    uint64_t last_id = 0;
+    std::deque<std::unique_ptr<Histogram>> histograms;
+    std::deque<std::unique_ptr<Counter>> counters;
+};
+
+// Per-stage latency of one camera path, all in the wbcam_stage_seconds
+// family with a stage label.
+inline Histogram &stage(const std::string &labels, const std::string &stage) {
+    return Registry::global().histogram("wbcam_stage_seconds", "Time spent in each stage of a camera's frame path.",
+                                        labels + ",stage=\"" + stage + "\"");
+}
+
+// Serves Registry::render() to anything that connects to 127.0.0.1:<port>,
+// wrapped in a minimal HTTP/1.0 response so Prometheus can scrape it and
+// curl can read it.
+class MetricsServer {
+public:
+    ~MetricsServer() {
+        stop();
+    }
+
+    bool start(int port, Registry &registry = Registry::global()) {
+        this->registry = &registry;
+
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            perror("socket");
+            return false;
+        }
+        int on = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+            perror("bind");
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        running = true;
+        thread = std::thread(&MetricsServer::serve, this);
+        g_print("Metrics at http://127.0.0.1:%d/metrics\n", port);
+        return true;
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            listen_fd = -1;
+        }
+    }
+
+private:
+    void serve() {
+        while (running) {
+            struct pollfd pfd = {listen_fd, POLLIN, 0};
+            if (poll(&pfd, 1, 500) <= 0) {
+                continue;
+            }
+            int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+
+            // Whatever the request, the answer is the same; just give the
+            // client a moment to send it so closing does not reset it.
+            char request[1024];
+            struct pollfd cpfd = {client, POLLIN, 0};
+            if (poll(&cpfd, 1, 200) > 0) {
+                ssize_t n = read(client, request, sizeof(request));
+                (void)n;
+            }
+
+            std::string body = registry->render();
+            std::string response = "HTTP/1.0 200 OK\r\n"
+                                   "Content-Type: text/plain; version=0.0.4\r\n"
+                                   "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    break;
+                }
+                sent += n;
+            }
+            close(client);
+        }
+    }
+
+    Registry *registry = nullptr;
+    int listen_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+};
+
+} // namespace metrics
+
+#endif // METRICS_H
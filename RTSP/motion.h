@@ -0,0 +1,153 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <gst/gst.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+struct MotionSettings {
+    bool enabled = false;
+    int threshold = 6;                       // mean luma change that marks a 16x16 block as changed
+    int min_blocks = 3;                      // changed blocks needed to call it motion
+    GstClockTime hold = 3 * GST_SECOND;      // stay at full rate this long after the last motion
+    int idle_fps = 1;                        // frames encoded per second while the scene is static
+    GstClockTime keyframe_interval = GST_SECOND;  // the encoder's GOP at full rate; set by the camera
+};
+
+// Decides per captured frame whether it is worth encoding.
+//
+// The Y plane is reduced to one mean per 16x16 block (every other row is
+// sampled, summed with psadbw / vpaddl), and compared with the block means
+// of the last frame that was encoded. While blocks keep changing, and for
+// `hold` after they stop, every frame passes; a static scene passes only
+// `idle_fps` frames per second. The frame in which motion shows up is never
+// held back, so motion starts without added latency.
+//
+// The encoder counts its GOP in frames, so at the idle rate it would stretch
+// to many seconds, and so would a new viewer's wait for a picture and the
+// pre-roll trimming. The gate therefore asks for a keyframe when motion
+// starts and, while idle, whenever `keyframe_interval` has passed.
+class MotionGate {
+public:
+    static constexpr int BLOCK = 16;
+
+    MotionGate(int width, int height, const MotionSettings &settings)
+        : settings(settings),
+          blocks_x(width / BLOCK), blocks_y(height / BLOCK),
+          current(blocks_x * blocks_y), reference(blocks_x * blocks_y),
+          idle_period(gst_util_uint64_scale_int(1, GST_SECOND, settings.idle_fps > 0 ? settings.idle_fps : 1)) {}
+
+    // Returns true if the frame captured at `time` should be encoded.
+    bool admit(const uint8_t *y, size_t stride, GstClockTime time) {
+        ++analyzed;
+        block_means(y, stride);
+
+        int changed = 0;
+        for (size_t i = 0; i < current.size(); ++i) {
+            if (std::abs((int)current[i] - (int)reference[i]) > settings.threshold) {
+                ++changed;
+            }
+        }
+        if (last_encoded == GST_CLOCK_TIME_NONE || changed >= settings.min_blocks) {
+            last_motion = time;
+        }
+
+        bool was_moving = moving;
+        moving = time - last_motion < settings.hold;
+        changed_state = moving != was_moving;
+
+        bool encode = moving || time - last_encoded >= idle_period;
+        keyframe = false;
+        if (encode) {
+            reference.swap(current);
+            last_encoded = time;
+            keyframe = moving ? changed_state
+                              : last_keyframe == GST_CLOCK_TIME_NONE || time - last_keyframe >= settings.keyframe_interval;
+            if (keyframe) {
+                last_keyframe = time;
+            }
+        } else {
+            ++skipped;
+        }
+        return encode;
+    }
+
+    // Whether the last admit() started or ended a motion interval.
+    bool state_changed() const { return changed_state; }
+    bool in_motion() const { return moving; }
+
+    // Whether the frame admit() just let through should be a keyframe.
+    bool wants_keyframe() const { return keyframe; }
+
+    guint64 analyzed_frames() const { return analyzed.load(std::memory_order_relaxed); }
+    guint64 skipped_frames() const { return skipped.load(std::memory_order_relaxed); }
+
+private:
+    void block_means(const uint8_t *y, size_t stride) {
+        // Half the rows of a block are summed, so a block sum covers 128 samples.
+        for (int by = 0; by < blocks_y; ++by) {
+            uint16_t *out = &current[by * blocks_x];
+            for (int bx = 0; bx < blocks_x; ++bx) {
+                out[bx] = 0;
+            }
+            for (int row = 0; row < BLOCK; row += 2) {
+                accumulate_row(y + (size_t)(by * BLOCK + row) * stride, out);
+            }
+            for (int bx = 0; bx < blocks_x; ++bx) {
+                out[bx] = (out[bx] + 64) >> 7;
+            }
+        }
+    }
+
+    // Adds the sum of every 16-pixel run of `row` to its block.
+    void accumulate_row(const uint8_t *row, uint16_t *sums) const {
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        for (int bx = 0; bx < blocks_x; ++bx) {
+            __m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(row + bx * BLOCK)), zero);
+            sums[bx] += (uint16_t)(_mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4));
+        }
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+        for (int bx = 0; bx < blocks_x; ++bx) {
+            uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vld1q_u8(row + bx * BLOCK))));
+            sums[bx] += (uint16_t)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+        }
+#else
+        for (int bx = 0; bx < blocks_x; ++bx) {
+            const uint8_t *px = row + bx * BLOCK;
+            int sum = 0;
+            for (int i = 0; i < BLOCK; ++i) {
+                sum += px[i];
+            }
+            sums[bx] += (uint16_t)sum;
+        }
+#endif
+    }
+
+    MotionSettings settings;
+    int blocks_x;
+    int blocks_y;
+    std::vector<uint16_t> current;
+    std::vector<uint16_t> reference;     // block means of the last encoded frame
+    GstClockTime idle_period;
+    GstClockTime last_encoded = GST_CLOCK_TIME_NONE;
+    GstClockTime last_motion = 0;
+    GstClockTime last_keyframe = GST_CLOCK_TIME_NONE;
+    bool moving = false;
+    bool changed_state = false;
+    bool keyframe = false;
+    std::atomic<guint64> analyzed{0};
+    std::atomic<guint64> skipped{0};
+};
+
+#endif // MOTION_H
@@ -0,0 +1,110 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+#include <cstdlib>
+#include <string>
+
+// RTP over UDP multicast. A mount is already shared by all of its clients,
+// but with unicast every client still gets its own copy of each packet. With
+// multicast the media's single udpsink sends each packet once to a group
+// that every viewer joins, whatever the number of viewers.
+//
+// Every mount takes one group address and RTP/RTCP port pair from a pool
+// shared by all mounts, so the range must hold at least as many address and
+// port pairs as there are renditions. The defaults are in the
+// administratively scoped 239.255/16 block with a TTL of 1, so packets never
+// leave the LAN. On a box without a default route multicast needs a route to
+// loop back locally: ip route add 239.0.0.0/8 dev lo
+struct MulticastSettings {
+    bool enabled = false;
+    std::string min_address = "239.255.42.1";
+    std::string max_address = "239.255.42.254";
+    int min_port = 5000;             // even: RTP on even ports, RTCP on the next
+    int max_port = 5999;
+    int ttl = 1;
+    std::string iface;               // empty: whatever the routing table says
+    bool unicast_fallback = false;   // also serve UDP and TCP unicast to clients that cannot join
+};
+
+// "A-B" into `low` and `high`; a single value sets both.
+inline bool parse_range(const std::string &range, std::string &low, std::string &high) {
+    size_t dash = range.find('-');
+    low = range.substr(0, dash);
+    high = dash == std::string::npos ? low : range.substr(dash + 1);
+    return !low.empty() && !high.empty();
+}
+
+inline bool parse_port_range(const std::string &range, int &low, int &high) {
+    std::string first, last;
+    if (!parse_range(range, first, last)) {
+        return false;
+    }
+    low = std::atoi(first.c_str());
+    high = std::atoi(last.c_str());
+    return low > 0 && low % 2 == 0 && high > low && high < 65536;
+}
+
+// The address pool and transport options applied to every mount's factory.
+class MulticastTransport {
+public:
+    ~MulticastTransport() {
+        if (pool) {
+            g_object_unref(pool);
+        }
+    }
+
+    // Does nothing unless settings.enabled; false for an unusable range.
+    bool configure(const MulticastSettings &settings) {
+        this->settings = settings;
+        if (!settings.enabled) {
+            return true;
+        }
+        if (settings.ttl < 1 || settings.ttl > 255) {
+            g_printerr("Multicast TTL must be between 1 and 255\n");
+            return false;
+        }
+        pool = gst_rtsp_address_pool_new();
+        if (!gst_rtsp_address_pool_add_range(pool, settings.min_address.c_str(), settings.max_address.c_str(),
+                                             settings.min_port, settings.max_port, settings.ttl)) {
+            g_printerr("Invalid multicast range %s-%s ports %d-%d\n", settings.min_address.c_str(),
+                       settings.max_address.c_str(), settings.min_port, settings.max_port);
+            g_object_unref(pool);
+            pool = nullptr;
+            return false;
+        }
+        g_print("Multicast on %s-%s ports %d-%d, TTL %d%s\n", settings.min_address.c_str(),
+                settings.max_address.c_str(), settings.min_port, settings.max_port, settings.ttl,
+                settings.unicast_fallback ? ", unicast allowed" : "");
+        return true;
+    }
+
+    bool enabled() const { return pool != nullptr; }
+
+    void apply(GstRTSPMediaFactory *factory) const {
+        if (!pool) {
+            return;
+        }
+        gst_rtsp_media_factory_set_address_pool(factory, pool);
+        // Clients may ask for a TTL in SETUP; never route further than configured.
+        gst_rtsp_media_factory_set_max_mcast_ttl(factory, settings.ttl);
+        // Bind the sockets to the group address, so two mounts sharing a
+        // port number never see each other's packets.
+        gst_rtsp_media_factory_set_bind_mcast_address(factory, TRUE);
+        if (!settings.iface.empty()) {
+            gst_rtsp_media_factory_set_multicast_iface(factory, settings.iface.c_str());
+        }
+        int protocols = GST_RTSP_LOWER_TRANS_UDP_MCAST;
+        if (settings.unicast_fallback) {
+            protocols |= GST_RTSP_LOWER_TRANS_UDP | GST_RTSP_LOWER_TRANS_TCP;
+        }
+        gst_rtsp_media_factory_set_protocols(factory, (GstRTSPLowerTrans)protocols);
+    }
+
+private:
+    MulticastSettings settings;
+    GstRTSPAddressPool *pool = nullptr;
+};
+
+#endif // MULTICAST_H
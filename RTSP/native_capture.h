@@ -0,0 +1,128 @@
+#ifndef NATIVE_CAPTURE_H
+#define NATIVE_CAPTURE_H
+
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <sstream>
+#include <string>
+
+// Capture without cv::VideoCapture: a GStreamer pipeline pulls the camera's
+// own format and ends in an appsink, so no frame is ever decoded to BGR.
+//
+//   mjpeg  image/jpeg from the device, decoded once by jpegdec
+//   yuyv   raw YUY2, converted once to I420 (x264enc cannot take YUY2)
+//   nv12   raw NV12, handed to the encoder untouched
+//
+// The pipeline always ends in format(), which x264enc accepts directly; the
+// final videoconvert is a passthrough whenever the source already produces
+// it (jpegdec of a 4:2:0 JPEG, NV12 devices).
+//
+// `videotestsrc` stands in for a device: it produces the same raw format, or
+// JPEGs for mjpeg so the decode path is exercised. Files are decoded by
+// decodebin and replayed at their own rate.
+class NativeCapture {
+public:
+    static bool valid_mode(const std::string &mode) {
+        return mode == "mjpeg" || mode == "yuyv" || mode == "nv12";
+    }
+
+    // Raw format of the frames pull() returns for a capture mode.
+    static const char *format(const std::string &mode) {
+        return mode == "nv12" ? "NV12" : "I420";
+    }
+
+    ~NativeCapture() {
+        close();
+    }
+
+    std::string launch_string(const std::string &source, const std::string &mode,
+                              int width, int height, int fps) const {
+        std::ostringstream caps;
+        caps << "width=" << width << ",height=" << height << ",framerate=" << fps << "/1";
+        std::string raw_format = mode == "nv12" ? "NV12" : "YUY2";
+
+        std::ostringstream launch;
+        bool file = false;
+        if (source == "videotestsrc") {
+            launch << "videotestsrc is-live=true pattern=ball ! ";
+            if (mode == "mjpeg") {
+                launch << "video/x-raw,format=I420," << caps.str() << " ! jpegenc ! jpegdec ! ";
+            } else {
+                launch << "video/x-raw,format=" << raw_format << "," << caps.str() << " ! ";
+            }
+        } else if (!source.empty() && source.find_first_not_of("0123456789") == std::string::npos) {
+            launch << device_fragment("/dev/video" + source, mode, raw_format, caps.str());
+        } else if (source.compare(0, 5, "/dev/") == 0) {
+            launch << device_fragment(source, mode, raw_format, caps.str());
+        } else {
+            launch << "filesrc location=\"" << source << "\" ! decodebin ! videoscale ! videorate ! ";
+            file = true;
+        }
+        launch << "videoconvert ! video/x-raw,format=" << format(mode) << "," << caps.str() << " ! "
+               << "appsink name=sink max-buffers=2 drop=true sync=" << (file ? "true" : "false");
+        return launch.str();
+    }
+
+    bool open(const std::string &source, const std::string &mode, int width, int height, int fps) {
+        if (width % 8) {
+            // Narrower strides get padded, and the slot maps frames as packed planes.
+            g_printerr("Native capture needs a width divisible by 8, got %d\n", width);
+            return false;
+        }
+
+        GError *error = nullptr;
+        pipeline = gst_parse_launch(launch_string(source, mode, width, height, fps).c_str(), &error);
+        if (!pipeline) {
+            g_printerr("Failed to create capture pipeline for %s: %s\n", source.c_str(),
+                       error ? error->message : "unknown error");
+            g_clear_error(&error);
+            return false;
+        }
+        sink = GST_APP_SINK(gst_bin_get_by_name(GST_BIN(pipeline), "sink"));
+
+        if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+            g_printerr("Failed to start capture pipeline for %s\n", source.c_str());
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // Next frame, or nullptr on timeout, error or end of stream; eos() tells
+    // the last two apart from a timeout.
+    GstSample *pull(GstClockTime timeout) {
+        return gst_app_sink_try_pull_sample(sink, timeout);
+    }
+
+    bool eos() const {
+        return gst_app_sink_is_eos(sink);
+    }
+
+    void close() {
+        if (pipeline) {
+            gst_element_set_state(pipeline, GST_STATE_NULL);
+            gst_object_unref(sink);
+            gst_object_unref(pipeline);
+            pipeline = nullptr;
+            sink = nullptr;
+        }
+    }
+
+private:
+    static std::string device_fragment(const std::string &device, const std::string &mode,
+                                       const std::string &raw_format, const std::string &caps) {
+        std::ostringstream fragment;
+        fragment << "v4l2src device=" << device << " ! ";
+        if (mode == "mjpeg") {
+            fragment << "image/jpeg," << caps << " ! jpegdec ! ";
+        } else {
+            fragment << "video/x-raw,format=" << raw_format << "," << caps << " ! ";
+        }
+        return fragment.str();
+    }
+
+    GstElement *pipeline = nullptr;
+    GstAppSink *sink = nullptr;
+};
+
+#endif // NATIVE_CAPTURE_H
@@ -0,0 +1,247 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <gst/gst.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "metrics.h"
+
+// With `millis`, names made within the same second differ too.
+inline std::string generate_filename(const std::string &prefix, bool millis = false) {
+    auto now = std::chrono::system_clock::now();
+    std::time_t time = std::chrono::system_clock::to_time_t(now);
+    std::tm *ltm = std::localtime(&time);
+    char filename[100];
+    size_t len = std::strftime(filename, sizeof(filename), "_%Y-%m-%d_%H-%M-%S", ltm);
+    if (millis) {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+        snprintf(filename + len, sizeof(filename) - len, "-%03d", (int)ms);
+    }
+    return prefix + filename + ".mp4";
+}
+
+struct RecordSettings {
+    std::string prefix;                          // empty disables recording
+    GstClockTime segment_time = 60 * GST_SECOND;
+    guint64 segment_bytes = 0;                   // 0 means no size limit
+    bool write_index = true;
+};
+
+// Continuous recording into rotating MP4 segments.
+//
+// Rotation is done by splitmuxsink: cuts land on keyframes (and the encoder
+// is asked for one when a segment is due), and with async-finalize the next
+// segment gets a fresh mp4mux/filesink while the previous one writes its moov
+// in the background, so the switch neither blocks nor loses frames.
+//
+// Next to every segment an index file `<segment>.idx` lists its start PTS and
+// the byte offset of each keyframe in the MP4, and the stretches in which the
+// camera saw motion (see mark_motion):
+//   start_pts <ns>
+//   keyframe <pts ns> <byte offset>
+//   motion <start pts ns> <end pts ns>
+class SegmentRecorder {
+public:
+    explicit SegmentRecorder(const RecordSettings &settings) : settings(settings) {}
+
+    bool enabled() const { return !settings.prefix.empty(); }
+
+    std::string launch_fragment() const {
+        std::ostringstream launch;
+        launch << "splitmuxsink name=rec async-finalize=true send-keyframe-requests=true "
+               << "muxer-factory=mp4mux sink-factory=filesink "
+               << "max-size-time=" << settings.segment_time
+               << " max-size-bytes=" << settings.segment_bytes;
+        return launch.str();
+    }
+
+    void attach(GstElement *splitmux) {
+        g_signal_connect(splitmux, "format-location-full", G_CALLBACK(format_location), this);
+        if (settings.write_index || latency) {
+            g_signal_connect(splitmux, "sink-added", G_CALLBACK(sink_added), this);
+        }
+    }
+
+    // Records, for every sample reaching a segment's filesink, the running
+    // time since its capture. Call before attach().
+    void set_latency_histogram(metrics::Histogram *histogram) {
+        latency = histogram;
+    }
+
+    // Starts or ends a motion interval at `pts` (the capture time of the
+    // frame that changed it).
+    void mark_motion(GstClockTime pts, bool moving) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (moving) {
+            motion.emplace_back(pts, GST_CLOCK_TIME_NONE);
+        } else if (!motion.empty() && motion.back().second == GST_CLOCK_TIME_NONE) {
+            motion.back().second = pts;
+        }
+    }
+
+    // Called from the pipeline's bus watch.
+    void handle_message(GstMessage *msg) {
+        const GstStructure *s = gst_message_get_structure(msg);
+        if (s && gst_structure_has_name(s, "splitmuxsink-fragment-closed")) {
+            g_print("Video saved: %s\n", gst_structure_get_string(s, "location"));
+        }
+    }
+
+private:
+    // Byte position and keyframe offsets of one segment file, tracked from
+    // what reaches its filesink.
+    struct SegmentIndex {
+        SegmentRecorder *recorder;
+        GstElement *sink;
+        guint64 position = 0;
+        GstClockTime last_pts = 0;
+        std::vector<std::pair<GstClockTime, guint64>> keyframes;
+    };
+
+    static gchar *format_location(GstElement *splitmux, guint fragment_id, GstSample *first_sample, gpointer user_data) {
+        SegmentRecorder *recorder = static_cast<SegmentRecorder *>(user_data);
+        // Small --segment-mb can cut twice within a second.
+        std::string filename = generate_filename(recorder->settings.prefix, true);
+
+        GstBuffer *first = first_sample ? gst_sample_get_buffer(first_sample) : nullptr;
+        {
+            std::lock_guard<std::mutex> lock(recorder->mutex);
+            recorder->start_pts[filename] = first ? GST_BUFFER_PTS(first) : GST_CLOCK_TIME_NONE;
+        }
+
+        g_print("Saving video to file: %s\n", filename.c_str());
+        return g_strdup(filename.c_str());
+    }
+
+    static void sink_added(GstElement *splitmux, GstElement *sink, gpointer user_data) {
+        SegmentIndex *index = new SegmentIndex();
+        index->recorder = static_cast<SegmentRecorder *>(user_data);
+        index->sink = sink;
+
+        GstPad *pad = gst_element_get_static_pad(sink, "sink");
+        gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                          index_probe, index, [](gpointer data) { delete static_cast<SegmentIndex *>(data); });
+        gst_object_unref(pad);
+    }
+
+    static GstPadProbeReturn index_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+        SegmentIndex *index = static_cast<SegmentIndex *>(user_data);
+
+        if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER) {
+            GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+            // mp4mux forwards the H.264 samples themselves into mdat, so the
+            // sample flags tell us where the keyframes land in the file.
+            if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+                index->last_pts = std::max(index->last_pts, GST_BUFFER_PTS(buffer));
+                index->recorder->record_latency(index->sink, GST_BUFFER_PTS(buffer));
+            }
+            if (GST_BUFFER_PTS_IS_VALID(buffer) &&
+                !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) &&
+                !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER)) {
+                index->keyframes.emplace_back(GST_BUFFER_PTS(buffer), index->position);
+            }
+            index->position += gst_buffer_get_size(buffer);
+            return GST_PAD_PROBE_OK;
+        }
+
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT) {
+            // The muxer seeks back to patch the mdat size when it finishes.
+            const GstSegment *segment;
+            gst_event_parse_segment(event, &segment);
+            if (segment->format == GST_FORMAT_BYTES) {
+                index->position = segment->start;
+            }
+        } else if (GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
+            if (index->recorder->settings.write_index) {
+                index->recorder->write_index(*index);
+            }
+            index->keyframes.clear();
+            index->position = 0;
+            index->last_pts = 0;
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    void record_latency(GstElement *sink, GstClockTime pts) {
+        if (!latency) {
+            return;
+        }
+        GstClock *clock = gst_element_get_clock(sink);
+        if (!clock) {
+            return;
+        }
+        GstClockTime now = gst_clock_get_time(clock) - gst_element_get_base_time(sink);
+        if (now > pts) {
+            latency->record(now - pts);
+        }
+        gst_object_unref(clock);
+    }
+
+    void write_index(const SegmentIndex &index) {
+        gchar *location = nullptr;
+        g_object_get(index.sink, "location", &location, NULL);
+        if (!location) {
+            return;
+        }
+
+        GstClockTime start = GST_CLOCK_TIME_NONE;
+        std::vector<std::pair<GstClockTime, GstClockTime>> segment_motion;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = start_pts.find(location);
+            if (it != start_pts.end()) {
+                start = it->second;
+                start_pts.erase(it);
+            }
+            if (start == GST_CLOCK_TIME_NONE && !index.keyframes.empty()) {
+                start = index.keyframes.front().first;
+            }
+            segment_motion = take_motion(start, index.last_pts);
+        }
+
+        std::ofstream file(std::string(location) + ".idx");
+        file << "start_pts " << start << "\n";
+        for (const auto &keyframe : index.keyframes) {
+            file << "keyframe " << keyframe.first << " " << keyframe.second << "\n";
+        }
+        for (const auto &interval : segment_motion) {
+            file << "motion " << interval.first << " " << interval.second << "\n";
+        }
+        g_free(location);
+    }
+
+    // Motion intervals overlapping [start, end], clipped to it. Intervals
+    // that end inside it are done with, since segments close in order.
+    std::vector<std::pair<GstClockTime, GstClockTime>> take_motion(GstClockTime start, GstClockTime end) {
+        std::vector<std::pair<GstClockTime, GstClockTime>> overlap;
+        if (start == GST_CLOCK_TIME_NONE) {
+            start = 0;
+        }
+        for (const auto &interval : motion) {
+            if (interval.first <= end && interval.second >= start) {
+                overlap.emplace_back(std::max(interval.first, start), std::min(interval.second, end));
+            }
+        }
+        while (!motion.empty() && motion.front().second <= end) {
+            motion.erase(motion.begin());
+        }
+        return overlap;
+    }
+
+    RecordSettings settings;
+    metrics::Histogram *latency = nullptr;
+    std::mutex mutex;
+    std::map<std::string, GstClockTime> start_pts;
+    std::vector<std::pair<GstClockTime, GstClockTime>> motion;   // end NONE: still moving
+};
+
+#endif // RECORDER_H
@@ -0,0 +1,406 @@
+#ifndef RENDITION_H
+#define RENDITION_H
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/rtsp-server/rtsp-server.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "encoder.h"
+#include "frame_ring.h"
+#include "metrics.h"
+
+// One rung of the encoding ladder: its mount suffix, the divisor applied to
+// the capture size and the share of the top bitrate it starts with.
+struct RenditionSpec {
+    std::string name;
+    int divisor;
+    int bitrate_percent;
+};
+
+// Parses a comma separated list of full, half and quarter. The first rung
+// is always full, since it is the one that records.
+inline bool parse_ladder(const std::string &list, std::vector<RenditionSpec> &ladder) {
+    static const RenditionSpec known[] = {{"full", 1, 100}, {"half", 2, 35}, {"quarter", 4, 12}};
+    ladder.clear();
+    ladder.push_back(known[0]);
+    std::istringstream names(list);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        auto spec = std::find_if(std::begin(known), std::end(known),
+                                 [&name](const RenditionSpec &k) { return k.name == name; });
+        if (spec == std::end(known)) {
+            return false;
+        }
+        if (spec->name != "full") {
+            ladder.push_back(*spec);
+        }
+    }
+    return true;
+}
+
+// Loss-driven bitrate for one encoder, fed by the RTCP receiver reports of
+// every client on its mount. Reports are collected over a window and the
+// worst loss wins, since all of those clients share the one stream: any
+// client above LOSS_HIGH cuts the rate by a quarter, and only when every
+// client stayed below LOSS_LOW does it grow back by a tenth of the maximum.
+class BitrateController {
+public:
+    static constexpr unsigned LOSS_HIGH = 26;   // RTCP fraction lost, in 1/256 (~10 %)
+    static constexpr unsigned LOSS_LOW = 5;     // ~2 %
+    static constexpr gint64 WINDOW_US = 2 * G_USEC_PER_SEC;
+
+    BitrateController(int max_kbps, int min_kbps)
+        : max_kbps(max_kbps), min_kbps(min_kbps), current(max_kbps) {}
+
+    // Records one report block; returns the new bitrate when a window
+    // closes with a change, otherwise 0.
+    int on_report(unsigned fraction_lost) {
+        std::lock_guard<std::mutex> lock(mutex);
+        worst_loss = std::max(worst_loss, fraction_lost);
+
+        gint64 now = g_get_monotonic_time();
+        if (window_start == 0) {
+            window_start = now;
+        }
+        if (now - window_start < WINDOW_US) {
+            return 0;
+        }
+
+        int next = current;
+        if (worst_loss > LOSS_HIGH) {
+            next = std::max(min_kbps, current * 3 / 4);
+        } else if (worst_loss < LOSS_LOW) {
+            next = std::min(max_kbps, current + max_kbps / 10);
+        }
+        window_start = now;
+        worst_loss = 0;
+        if (next == current) {
+            return 0;
+        }
+        current = next;
+        return next;
+    }
+
+    int bitrate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current;
+    }
+
+private:
+    std::mutex mutex;
+    const int max_kbps;
+    const int min_kbps;
+    int current;
+    unsigned worst_loss = 0;
+    gint64 window_start = 0;
+};
+
+// One encoding of a camera and its RTSP mount. Every rendition has its own
+// cursor on the camera's frame ring and its own encoder, so a lower rung
+// scales the same captured frame instead of capturing again. The mount is
+// shared: all of its clients get the one stream, and clients pick a rung by
+// choosing the mount that fits their link.
+class Rendition {
+public:
+    using SampleCallback = Encoder::SampleCallback;
+
+    Rendition(const std::string &name, const EncoderSettings &settings, FrameRing &ring)
+        : name(name),
+          feed(ring, name + "/encoder"),
+          encoder(name, settings),
+          abr(settings.bitrate, std::max(settings.bitrate / 4, 100)),
+          labels(metric_labels(name)),
+          push_stage(metrics::stage(labels, "push")),
+          encode_stage(metrics::stage(labels, "encode")),
+          payload_stage(metrics::stage(labels, "payload")) {
+        metrics::Registry &registry = metrics::Registry::global();
+        exposed = {
+            registry.expose("wbcam_frames_pushed_total", "Frames handed to an encoder.", "counter", labels,
+                            [this] { return (double)pushed_frames.load(); }),
+            registry.expose("wbcam_frames_dropped_total", "Frames dropped, by where they were dropped.", "counter",
+                            labels + ",reason=\"backpressure\"", [this] { return (double)backpressure_drops.load(); }),
+            registry.expose("wbcam_bitrate_kbps", "Current encoder bitrate.", "gauge", labels,
+                            [this] { return (double)abr.bitrate(); }),
+        };
+        if (!settings.record.prefix.empty()) {
+            encoder.set_record_latency(&metrics::stage(labels, "record"));
+        }
+    }
+
+    ~Rendition() {
+        for (uint64_t id : exposed) {
+            metrics::Registry::global().unexpose(id);
+        }
+        std::lock_guard<std::mutex> lock(live_mutex);
+        if (live_src) {
+            gst_object_unref(live_src);
+        }
+    }
+
+    const std::string &get_name() const { return name; }
+    std::string mount_path() const { return "/" + name; }
+    Encoder &get_encoder() { return encoder; }
+
+    // `on_encoded` sees every access unit before it goes to the mount.
+    bool start(SampleCallback on_encoded, const Rendition *time_base = nullptr) {
+        this->on_encoded = on_encoded;
+        return encoder.start([this](GstSample *sample) { on_sample(sample); },
+                             time_base ? &time_base->encoder : nullptr);
+    }
+
+    void stop() {
+        encoder.stop();
+    }
+
+    // Pushes the frame just published, exactly once. appsrc keeps at most
+    // max_queue_bytes queued and drops the oldest frame (leaky downstream)
+    // when the encoder falls behind; that case is counted here.
+    void push_frame() {
+        FrameSlot *slot = feed.latest();
+        if (!slot) {
+            return;
+        }
+
+        GstBuffer *buffer = FrameRing::wrap(slot);
+        if (!buffer) {
+            g_print("%s: Failed to create buffer\n", name.c_str());
+            FrameRing::release(slot);
+            return;
+        }
+        const EncoderSettings &settings = encoder.get_settings();
+        GST_BUFFER_PTS(buffer) = slot->capture_time;
+        GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale_int(1, GST_SECOND, settings.fps);
+
+        GstAppSrc *appsrc = encoder.source();
+        if (gst_app_src_get_current_level_bytes(appsrc) + slot->i420_size() > settings.max_queue_bytes) {
+            backpressure_drops.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        uint64_t start = metrics::now_ns();
+        GstFlowReturn ret = gst_app_src_push_buffer(appsrc, buffer);
+        push_stage.record_since(start);
+        if (ret != GST_FLOW_OK) {
+            g_print("%s: Push buffer returned %d\n", name.c_str(), ret);
+        } else {
+            pushed_frames.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Frames handed to the encoder, frames it saw twice (the push path never
+    // repeats one) and frames dropped inside the encoder queue.
+    void print_feed_stats() {
+        g_print("[%s] encoder feed: pushed %" G_GUINT64_FORMAT ", duplicated %" G_GUINT64_FORMAT
+                ", dropped by backpressure %" G_GUINT64_FORMAT ", bitrate %d kbit/s\n",
+                name.c_str(), pushed_frames.load(), feed.repeated(), backpressure_drops.load(), abr.bitrate());
+    }
+
+    // The mount only packetizes: it is fed the rendition's already encoded
+    // H.264, so its RTSP viewers and the recorder share one encode.
+    GstRTSPMediaFactory *create_factory() {
+        std::string launch_str =
+            "( appsrc name=source is-live=true format=time do-timestamp=true ! "
+            "rtph264pay config-interval=1 name=pay0 pt=96 )";
+
+        GstRTSPMediaFactory *factory = gst_rtsp_media_factory_new();
+        gst_rtsp_media_factory_set_launch(factory, launch_str.c_str());
+        gst_rtsp_media_factory_set_shared(factory, TRUE);
+        gst_rtsp_media_factory_set_latency(factory, 0);
+
+        g_signal_connect(factory, "media-configure", G_CALLBACK(media_configure), this);
+        return factory;
+    }
+
+private:
+    // camera="cam0",rendition="half" for the rendition named cam0/half.
+    static std::string metric_labels(const std::string &name) {
+        size_t slash = name.find('/');
+        std::string camera = name.substr(0, slash);
+        std::string rung = slash == std::string::npos ? "full" : name.substr(slash + 1);
+        return "camera=\"" + camera + "\",rendition=\"" + rung + "\"";
+    }
+
+    void on_sample(GstSample *sample) {
+        GstBuffer *encoded = gst_sample_get_buffer(sample);
+        GstClockTime now = encoder.running_time();
+        if (GST_BUFFER_PTS_IS_VALID(encoded) && GST_CLOCK_TIME_IS_VALID(now) && now > GST_BUFFER_PTS(encoded)) {
+            encode_stage.record(now - GST_BUFFER_PTS(encoded));
+        }
+        if (on_encoded) {
+            on_encoded(sample);
+        }
+        push_live(sample);
+    }
+
+    // Hands one encoded access unit to the RTSP media, if a client has it
+    // prepared. A fresh media starts at the next keyframe.
+    void push_live(GstSample *sample) {
+        std::lock_guard<std::mutex> lock(live_mutex);
+        if (!live_src) {
+            return;
+        }
+
+        GstBuffer *encoded = gst_sample_get_buffer(sample);
+        if (live_needs_keyframe) {
+            if (GST_BUFFER_FLAG_IS_SET(encoded, GST_BUFFER_FLAG_DELTA_UNIT)) {
+                return;
+            }
+            live_needs_keyframe = false;
+        }
+        if (gst_app_src_get_current_level_bytes(live_src) > MAX_LIVE_QUEUE_BYTES) {
+            // The media is not draining; skip ahead to the next keyframe.
+            live_needs_keyframe = true;
+            return;
+        }
+
+        // Metadata-only copy: the payload memory is shared, not duplicated.
+        // Timestamps are cleared so appsrc restamps in the media's running time.
+        GstBuffer *buffer = gst_buffer_copy(encoded);
+        GST_BUFFER_PTS(buffer) = GST_CLOCK_TIME_NONE;
+        GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+        live_push_ns.store(metrics::now_ns(), std::memory_order_relaxed);
+        gst_app_src_push_buffer(live_src, buffer);
+    }
+
+    static void media_configure(GstRTSPMediaFactory *factory, GstRTSPMedia *media, gpointer user_data) {
+        Rendition *rendition = static_cast<Rendition *>(user_data);
+        GstElement *element = gst_rtsp_media_get_element(media);
+        GstAppSrc *appsrc = GST_APP_SRC(gst_bin_get_by_name_recurse_up(GST_BIN(element), "source"));
+
+        gst_app_src_set_stream_type(appsrc, GST_APP_STREAM_TYPE_STREAM);
+
+        const EncoderSettings &settings = rendition->encoder.get_settings();
+        GstCaps *caps = gst_caps_new_simple("video/x-h264",
+                                           "stream-format", G_TYPE_STRING, "byte-stream",
+                                           "alignment", G_TYPE_STRING, "au",
+                                           "width", G_TYPE_INT, settings.scale_width ? settings.scale_width : settings.width,
+                                           "height", G_TYPE_INT, settings.scale_height ? settings.scale_height : settings.height,
+                                           "framerate", GST_TYPE_FRACTION, settings.fps, 1,
+                                           NULL);
+        gst_app_src_set_caps(appsrc, caps);
+        gst_caps_unref(caps);
+
+        {
+            std::lock_guard<std::mutex> lock(rendition->live_mutex);
+            if (rendition->live_src) {
+                gst_object_unref(rendition->live_src);
+            }
+            rendition->live_src = appsrc;
+            rendition->live_needs_keyframe = true;
+        }
+        g_signal_connect(media, "prepared", G_CALLBACK(media_prepared), rendition);
+        g_signal_connect(media, "unprepared", G_CALLBACK(media_unprepared), rendition);
+
+        GstElement *pay = gst_bin_get_by_name_recurse_up(GST_BIN(element), "pay0");
+        if (pay) {
+            GstPad *pad = gst_element_get_static_pad(pay, "src");
+            gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                              payload_probe, rendition, NULL);
+            gst_object_unref(pad);
+            gst_object_unref(pay);
+        }
+
+        gst_object_unref(element);
+    }
+
+    // The RTP packet with the marker bit closes an access unit: the payload
+    // stage runs from handing that unit to the mount until it leaves here.
+    static GstPadProbeReturn payload_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+        Rendition *rendition = static_cast<Rendition *>(user_data);
+        GstBuffer *last;
+        if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+            GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+            guint length = gst_buffer_list_length(list);
+            last = length ? gst_buffer_list_get(list, length - 1) : nullptr;
+        } else {
+            last = GST_PAD_PROBE_INFO_BUFFER(info);
+        }
+        if (last && GST_BUFFER_FLAG_IS_SET(last, GST_BUFFER_FLAG_MARKER)) {
+            rendition->payload_stage.record_since(rendition->live_push_ns.load(std::memory_order_relaxed));
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    // The RTP sessions only exist once the media is prepared; listen there
+    // for the receiver reports of every client.
+    static void media_prepared(GstRTSPMedia *media, gpointer user_data) {
+        for (guint i = 0; i < gst_rtsp_media_n_streams(media); ++i) {
+            GObject *session = gst_rtsp_stream_get_rtpsession(gst_rtsp_media_get_stream(media, i));
+            if (session) {
+                g_signal_connect(session, "on-ssrc-active", G_CALLBACK(on_ssrc_active), user_data);
+                g_object_unref(session);
+            }
+        }
+    }
+
+    // Only if it is still the live media: a newer one may have replaced it
+    // before this one was torn down.
+    static void media_unprepared(GstRTSPMedia *media, gpointer user_data) {
+        Rendition *rendition = static_cast<Rendition *>(user_data);
+        GstElement *element = gst_rtsp_media_get_element(media);
+        GstElement *appsrc = gst_bin_get_by_name_recurse_up(GST_BIN(element), "source");
+        {
+            std::lock_guard<std::mutex> lock(rendition->live_mutex);
+            if (rendition->live_src && GST_ELEMENT(rendition->live_src) == appsrc) {
+                gst_object_unref(rendition->live_src);
+                rendition->live_src = nullptr;
+            }
+        }
+        if (appsrc) {
+            gst_object_unref(appsrc);
+        }
+        gst_object_unref(element);
+    }
+
+    // Called on the RTP session thread whenever a client's RTCP arrives.
+    static void on_ssrc_active(GObject *session, GObject *source, gpointer user_data) {
+        Rendition *rendition = static_cast<Rendition *>(user_data);
+        GstStructure *stats = nullptr;
+        g_object_get(source, "stats", &stats, NULL);
+        if (!stats) {
+            return;
+        }
+
+        gboolean internal = FALSE, have_rb = FALSE;
+        guint fraction_lost = 0;
+        gst_structure_get_boolean(stats, "internal", &internal);
+        gst_structure_get_boolean(stats, "have-rb", &have_rb);
+        if (!internal && have_rb && gst_structure_get_uint(stats, "rb-fractionlost", &fraction_lost)) {
+            int bitrate = rendition->abr.on_report(fraction_lost);
+            if (bitrate > 0) {
+                g_print("[%s] receiver loss %u/256, bitrate now %d kbit/s\n",
+                        rendition->name.c_str(), fraction_lost, bitrate);
+                rendition->encoder.set_bitrate(bitrate);
+            }
+        }
+        gst_structure_free(stats);
+    }
+
+    static constexpr guint64 MAX_LIVE_QUEUE_BYTES = 2 * 1024 * 1024;
+
+    std::string name;
+    FrameConsumer feed;
+    Encoder encoder;
+    BitrateController abr;
+    SampleCallback on_encoded;
+    std::atomic<guint64> pushed_frames{0};
+    std::atomic<guint64> backpressure_drops{0};
+
+    // Stage timings, see metrics.h.
+    std::string labels;
+    metrics::Histogram &push_stage;         // gst_app_src_push_buffer into the encoder
+    metrics::Histogram &encode_stage;       // capture time to encoded access unit
+    metrics::Histogram &payload_stage;      // encoded access unit to its last RTP packet
+    std::atomic<uint64_t> live_push_ns{0};
+    std::vector<uint64_t> exposed;          // Registry::expose ids, read through `this`
+
+    std::mutex live_mutex;
+    GstAppSrc *live_src = nullptr;
+    bool live_needs_keyframe = true;
+};
+
+#endif // RENDITION_H
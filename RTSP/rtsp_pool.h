@@ -0,0 +1,50 @@
+#ifndef RTSP_POOL_H
+#define RTSP_POOL_H
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+// How the RTSP server spreads its clients over threads.
+//
+// The server socket is attached to the default main context, which then
+// only accepts connections. Each accepted client is handed to a thread of
+// the GstRTSPThreadPool, and every pool thread runs its own GMainContext, so
+// session setup, keep-alives and RTCP of different clients are handled in
+// parallel instead of queueing on the main loop. With threads = -1 every
+// client gets a thread and context of its own. With N > 0 the first N
+// clients each start a thread and later ones share them round robin.
+struct RtspPoolSettings {
+    int threads = 4;
+    int backlog = 128;          // connections the listen socket queues before accept
+    int max_sessions = 0;       // 0: no limit
+};
+
+inline void configure_rtsp_server(GstRTSPServer *server, const RtspPoolSettings &settings) {
+    GstRTSPThreadPool *pool = gst_rtsp_thread_pool_new();
+    gst_rtsp_thread_pool_set_max_threads(pool, settings.threads);
+    gst_rtsp_server_set_thread_pool(server, pool);
+    g_object_unref(pool);
+
+    // The default backlog of 5 refuses connections when many viewers
+    // connect at once.
+    gst_rtsp_server_set_backlog(server, settings.backlog);
+
+    GstRTSPSessionPool *sessions = gst_rtsp_server_get_session_pool(server);
+    gst_rtsp_session_pool_set_max_sessions(sessions, settings.max_sessions);
+    g_object_unref(sessions);
+}
+
+inline gboolean cleanup_sessions(gpointer user_data) {
+    GstRTSPSessionPool *sessions = gst_rtsp_server_get_session_pool(GST_RTSP_SERVER(user_data));
+    gst_rtsp_session_pool_cleanup(sessions);
+    g_object_unref(sessions);
+    return G_SOURCE_CONTINUE;
+}
+
+// Expires the sessions of clients that vanished without a TEARDOWN, so
+// their media and pool threads are released. Returns the timeout source.
+inline guint add_session_cleanup(GstRTSPServer *server) {
+    return g_timeout_add_seconds(2, cleanup_sessions, server);
+}
+
+#endif // RTSP_POOL_H
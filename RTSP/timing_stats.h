@@ -0,0 +1,68 @@
+#ifndef TIMING_STATS_H
+#define TIMING_STATS_H
+
+#include <gst/gst.h>
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+
+// Capture pacing and capture-to-send latency of one camera.
+//
+//   drift   capture clock vs. the nominal frame rate, accumulated since start
+//           (positive: the camera delivers slower than it claims)
+//   jitter  RFC 3550 style smoothed deviation of the frame interval
+//   latency pipeline running time when an encoded frame leaves the encoder
+//           minus the running time at which it was captured
+//
+// Written by the capture and encoder threads, read by the stats timer, so a
+// plain mutex is enough; it is never held for more than a few adds.
+class TimingStats {
+public:
+    explicit TimingStats(int fps) : period(gst_util_uint64_scale_int(1, GST_SECOND, fps)) {}
+
+    void on_capture(GstClockTime capture_time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (frames == 0) {
+            first_capture = capture_time;
+        } else {
+            GstClockTimeDiff deviation = (GstClockTimeDiff)(capture_time - last_capture) - (GstClockTimeDiff)period;
+            jitter += (std::llabs(deviation) - jitter) / 16.0;
+            drift = (GstClockTimeDiff)(capture_time - first_capture) - (GstClockTimeDiff)(frames * period);
+        }
+        last_capture = capture_time;
+        ++frames;
+    }
+
+    void on_send(GstClockTime latency) {
+        std::lock_guard<std::mutex> lock(mutex);
+        latency_sum += latency;
+        latency_max = std::max(latency_max, latency);
+        ++latency_count;
+    }
+
+    // Prints and resets the latency window; drift and jitter keep running.
+    void print(const char *name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        g_print("[%s] captured %" G_GUINT64_FORMAT " frames, drift %.1f ms, jitter %.2f ms, "
+                "capture-to-send avg %.1f ms max %.1f ms\n",
+                name, frames, drift / 1e6, jitter / 1e6,
+                latency_count ? latency_sum / 1e6 / latency_count : 0.0, latency_max / 1e6);
+        latency_sum = 0;
+        latency_max = 0;
+        latency_count = 0;
+    }
+
+private:
+    std::mutex mutex;
+    GstClockTime period;
+    guint64 frames = 0;
+    GstClockTime first_capture = 0;
+    GstClockTime last_capture = 0;
+    GstClockTimeDiff drift = 0;
+    double jitter = 0;
+    GstClockTime latency_sum = 0;
+    GstClockTime latency_max = 0;
+    guint64 latency_count = 0;
+};
+
+#endif // TIMING_STATS_H
@@ -0,0 +1,151 @@
+#ifndef TRIGGER_SERVER_H
+#define TRIGGER_SERVER_H
+
+#include <gst/gst.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Line protocol on a local UNIX stream socket, so a detector can ask for an
+// event clip with one write:
+//
+//   TRIGGER <camera|*> [post_seconds]\n   ->  OK <clip file>...\n
+//                                         ->  ERR <reason>\n
+//
+// Each connection may send any number of lines and stay open as long as it
+// likes; all connections are served together from one poll().
+class TriggerServer {
+public:
+    // Receives the camera name ("*" for all) and the post-roll in seconds
+    // (0 for the default); returns the reply line without the newline.
+    using Handler = std::function<std::string(const std::string &camera, int post_seconds)>;
+
+    ~TriggerServer() {
+        stop();
+    }
+
+    bool start(const std::string &path, Handler handler) {
+        this->path = path;
+        this->handler = handler;
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+            perror("socket");
+            return false;
+        }
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str());
+
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+            perror("bind");
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        running = true;
+        thread = std::thread(&TriggerServer::serve, this);
+        g_print("Event triggers on %s\n", path.c_str());
+        return true;
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            unlink(path.c_str());
+            listen_fd = -1;
+        }
+    }
+
+private:
+    struct Client {
+        int socket;
+        std::string pending;            // a partial line
+    };
+
+    void serve() {
+        std::vector<Client> clients;
+        while (running) {
+            std::vector<struct pollfd> fds = {{listen_fd, POLLIN, 0}};
+            for (const Client &client : clients) {
+                fds.push_back({client.socket, POLLIN, 0});
+            }
+            if (poll(fds.data(), fds.size(), 500) <= 0) {
+                continue;
+            }
+
+            // Walk backwards so erasing a client keeps the other indexes valid.
+            for (size_t i = fds.size() - 1; i > 0; --i) {
+                if (fds[i].revents && !handle_client(clients[i - 1])) {
+                    close(clients[i - 1].socket);
+                    clients.erase(clients.begin() + (i - 1));
+                }
+            }
+            if (fds[0].revents & POLLIN) {
+                int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (client >= 0) {
+                    clients.push_back({client, ""});
+                }
+            }
+        }
+        for (const Client &client : clients) {
+            close(client.socket);
+        }
+    }
+
+    // Returns false once the connection should be closed.
+    bool handle_client(Client &client) {
+        char buffer[256];
+        ssize_t n = read(client.socket, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return false;
+        }
+        client.pending.append(buffer, n);
+
+        size_t end;
+        while ((end = client.pending.find('\n')) != std::string::npos) {
+            std::string reply = handle_line(client.pending.substr(0, end)) + "\n";
+            client.pending.erase(0, end + 1);
+            if (send(client.socket, reply.data(), reply.size(), MSG_NOSIGNAL) < 0) {
+                return false;
+            }
+        }
+        return client.pending.size() <= 1024;
+    }
+
+    std::string handle_line(const std::string &line) {
+        std::istringstream fields(line);
+        std::string command, camera;
+        int post_seconds = 0;
+        fields >> command >> camera >> post_seconds;
+        if (command != "TRIGGER" || camera.empty()) {
+            return "ERR expected TRIGGER <camera|*> [post_seconds]";
+        }
+        return handler(camera, post_seconds);
+    }
+
+    std::string path;
+    Handler handler;
+    int listen_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+};
+
+#endif // TRIGGER_SERVER_H
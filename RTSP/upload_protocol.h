@@ -0,0 +1,503 @@
+#ifndef UPLOAD_PROTOCOL_H
+#define UPLOAD_PROTOCOL_H
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Event upload protocol between wbcam_detector and event_receiver, over TCP.
+//
+// Every message is a 24-byte header followed by `length` payload bytes, all
+// integers big-endian:
+//
+//   magic "WBCU" | version u8 | type u8 | flags u16 | seq u64 | length u32 | crc32 u32
+//
+//   HELLO  sender -> receiver  payload: sender id. The receiver answers with
+//                              an ACK carrying the last seq it stored for
+//                              that sender, and the sender resumes after it.
+//   EVENT  sender -> receiver  payload: "camera label confidence time_ms\n"
+//                              followed by the JPEG. seq counts up from 1.
+//   ACK    receiver -> sender  no payload; seq is cumulative: every event up
+//                              to and including it is on the receiver's disk.
+//
+// The sender writes a batch of EVENTs and sets ACK_REQUEST on the last one;
+// the receiver syncs the batch to disk and acknowledges it. The CRC covers
+// the payload. A bad magic, version or CRC closes the connection, and the
+// sender resends everything after the last ACK on the next one.
+namespace upload {
+
+const uint32_t MAGIC = 0x57424355;      // "WBCU"
+const uint8_t VERSION = 1;
+const size_t HEADER_SIZE = 24;
+const uint32_t MAX_PAYLOAD = 16 << 20;
+
+enum Type : uint8_t {
+    HELLO = 1,
+    EVENT = 2,
+    ACK = 3,
+};
+
+const uint16_t ACK_REQUEST = 1;
+
+inline uint32_t crc32(uint32_t crc, const void *data, size_t size) {
+    static uint32_t table[256];
+    static std::once_flag built;
+    std::call_once(built, [] {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    });
+
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+struct Header {
+    uint8_t type = 0;
+    uint16_t flags = 0;
+    uint64_t seq = 0;
+    uint32_t length = 0;
+    uint32_t crc = 0;
+
+    void encode(uint8_t *out) const {
+        uint32_t magic = htobe32(MAGIC);
+        uint16_t f = htobe16(flags);
+        uint64_t s = htobe64(seq);
+        uint32_t l = htobe32(length);
+        uint32_t c = htobe32(crc);
+        memcpy(out, &magic, 4);
+        out[4] = VERSION;
+        out[5] = type;
+        memcpy(out + 6, &f, 2);
+        memcpy(out + 8, &s, 8);
+        memcpy(out + 16, &l, 4);
+        memcpy(out + 20, &c, 4);
+    }
+
+    // False if this is not a header we understand.
+    bool decode(const uint8_t *in) {
+        uint32_t magic;
+        memcpy(&magic, in, 4);
+        if (be32toh(magic) != MAGIC || in[4] != VERSION) {
+            return false;
+        }
+        type = in[5];
+        memcpy(&flags, in + 6, 2);
+        memcpy(&seq, in + 8, 8);
+        memcpy(&length, in + 16, 4);
+        memcpy(&crc, in + 20, 4);
+        flags = be16toh(flags);
+        seq = be64toh(seq);
+        length = be32toh(length);
+        crc = be32toh(crc);
+        return length <= MAX_PAYLOAD;
+    }
+};
+
+// Splits a byte stream into messages, whatever the read sizes were.
+class Parser {
+public:
+    enum Result { NEED_MORE, MESSAGE, BAD };
+
+    void feed(const void *data, size_t size) {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        buffer.insert(buffer.end(), p, p + size);
+    }
+
+    // On MESSAGE, `header` and `payload` hold the next message.
+    Result next(Header &header, std::vector<uint8_t> &payload) {
+        if (buffer.size() - offset < HEADER_SIZE) {
+            compact();
+            return NEED_MORE;
+        }
+        if (!header.decode(buffer.data() + offset)) {
+            return BAD;
+        }
+        if (buffer.size() - offset < HEADER_SIZE + header.length) {
+            compact();
+            return NEED_MORE;
+        }
+        const uint8_t *body = buffer.data() + offset + HEADER_SIZE;
+        if (crc32(0, body, header.length) != header.crc) {
+            return BAD;
+        }
+        payload.assign(body, body + header.length);
+        offset += HEADER_SIZE + header.length;
+        return MESSAGE;
+    }
+
+private:
+    void compact() {
+        buffer.erase(buffer.begin(), buffer.begin() + offset);
+        offset = 0;
+    }
+
+    std::vector<uint8_t> buffer;
+    size_t offset = 0;
+};
+
+struct UploadSettings {
+    std::string host;
+    int port = 0;
+    std::string sender;             // identifies this sender's seq numbers to the receiver
+    std::string spool;              // keep snapshots in files here and sendfile() them
+    size_t max_pending = 256;       // unacknowledged events kept; the oldest go beyond
+    size_t batch = 8;               // events per acknowledgement
+    int timeout_ms = 5000;          // connect, send and ack timeout
+};
+
+// The sending side. enqueue() never blocks on the network: events wait in a
+// bounded queue until the receiver acknowledges them, and a thread of its
+// own connects, resumes after the receiver's last ACK and sends batches,
+// with writev() from memory or sendfile() from the spool directory.
+class Uploader {
+public:
+    explicit Uploader(const UploadSettings &settings) : settings(settings) {}
+
+    ~Uploader() {
+        stop();
+    }
+
+    void start() {
+        running = true;
+        thread = std::thread(&Uploader::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_one();
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (!pending.empty()) {
+            std::cerr << "Upload: " << pending.size() << " events were never acknowledged" << std::endl;
+        }
+        pending.clear();
+    }
+
+    void enqueue(const std::string &camera, const std::string &label, float confidence,
+                 uint64_t time_ms, const std::vector<unsigned char> &jpeg) {
+        std::shared_ptr<Event> event(new Event());
+        std::ostringstream meta;
+        meta << camera << " " << label << " " << confidence << " " << time_ms << "\n";
+        event->meta = meta.str();
+        event->jpeg_size = jpeg.size();
+        event->crc = crc32(crc32(0, event->meta.data(), event->meta.size()), jpeg.data(), jpeg.size());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        event->seq = ++last_seq;
+        if (!settings.spool.empty()) {
+            event->spool_path = settings.spool + "/" + std::to_string(event->seq) + ".jpg";
+            int fd = open(event->spool_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            bool written = fd >= 0 && write(fd, jpeg.data(), jpeg.size()) == (ssize_t)jpeg.size();
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (!written) {
+                std::cerr << "Upload: cannot spool " << event->spool_path << ", keeping it in memory" << std::endl;
+                event->spool_path.clear();
+            }
+        }
+        if (event->spool_path.empty()) {
+            event->jpeg = jpeg;
+        }
+
+        if (pending.size() >= settings.max_pending) {
+            pending.pop_front();
+            ++dropped;
+        }
+        pending.push_back(event);
+        ++queued;
+        wake.notify_one();
+    }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cout << "Upload: queued " << queued << ", acknowledged " << acknowledged
+                  << ", resent " << resent << ", dropped " << dropped
+                  << ", waiting " << pending.size() << std::endl;
+    }
+
+private:
+    struct Event {
+        uint64_t seq = 0;
+        std::string meta;
+        std::vector<unsigned char> jpeg;    // empty when spooled
+        std::string spool_path;
+        size_t jpeg_size = 0;
+        uint32_t crc = 0;
+        bool sent = false;
+
+        ~Event() {
+            if (!spool_path.empty()) {
+                unlink(spool_path.c_str());
+            }
+        }
+    };
+
+    void run() {
+        auto backoff = std::chrono::seconds(1);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            if (fd < 0) {
+                lock.unlock();
+                bool connected = connect_receiver();
+                lock.lock();
+                if (!connected) {
+                    wake.wait_for(lock, backoff, [this] { return !running; });
+                    backoff = std::min(backoff * 2, std::chrono::seconds(30));
+                    continue;
+                }
+                backoff = std::chrono::seconds(1);
+            }
+
+            wake.wait(lock, [this] { return !running || !pending.empty(); });
+            if (!running) {
+                break;
+            }
+            std::vector<std::shared_ptr<Event>> batch(pending.begin(),
+                                                      pending.begin() + std::min(settings.batch, pending.size()));
+            lock.unlock();
+            uint64_t acked = 0;
+            bool ok = send_batch(batch) && read_ack(acked);
+            lock.lock();
+            if (!ok) {
+                std::cerr << "Upload to " << settings.host << ":" << settings.port << " interrupted: "
+                          << strerror(errno) << std::endl;
+                disconnect();
+                continue;
+            }
+            acknowledge(acked);
+        }
+        disconnect();
+    }
+
+    // Connects and sends HELLO; the reply says where to resume.
+    bool connect_receiver() {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *addresses = nullptr;
+        if (getaddrinfo(settings.host.c_str(), std::to_string(settings.port).c_str(), &hints, &addresses) != 0) {
+            std::cerr << "Upload: cannot resolve " << settings.host << std::endl;
+            return false;
+        }
+
+        for (struct addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, a->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            bool connected = connect(fd, a->ai_addr, a->ai_addrlen) == 0 ||
+                             (errno == EINPROGRESS && poll(&pfd, 1, settings.timeout_ms) > 0 &&
+                              getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0);
+            if (!connected) {
+                disconnect();
+            }
+        }
+        freeaddrinfo(addresses);
+        if (fd < 0) {
+            return false;
+        }
+
+        // Blocking from here on, but never for longer than the timeout.
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        struct timeval timeout = {settings.timeout_ms / 1000, (settings.timeout_ms % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        Header hello;
+        hello.type = HELLO;
+        hello.length = settings.sender.size();
+        hello.crc = crc32(0, settings.sender.data(), settings.sender.size());
+        uint8_t header[HEADER_SIZE];
+        hello.encode(header);
+        struct iovec iov[2] = {{header, HEADER_SIZE}, {const_cast<char *>(settings.sender.data()), settings.sender.size()}};
+        uint64_t acked = 0;
+        if (!send_iov(iov, 2) || !read_ack(acked)) {
+            disconnect();
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        acknowledge(acked);
+        for (auto &event : pending) {
+            if (event->sent) {
+                ++resent;
+                event->sent = false;
+            }
+        }
+        std::cout << "Uploading events to " << settings.host << ":" << settings.port
+                  << ", resuming after #" << acked << std::endl;
+        return true;
+    }
+
+    // Headers and metadata are gathered into writev() calls; spooled JPEGs
+    // go out with sendfile() in between, corked into full segments.
+    bool send_batch(const std::vector<std::shared_ptr<Event>> &batch) {
+        int cork = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+        std::vector<uint8_t> headers(batch.size() * HEADER_SIZE);
+        std::vector<struct iovec> iov;
+        bool ok = true;
+        for (size_t i = 0; i < batch.size() && ok; ++i) {
+            const Event &event = *batch[i];
+            Header header;
+            header.type = EVENT;
+            header.flags = i + 1 == batch.size() ? ACK_REQUEST : 0;
+            header.seq = event.seq;
+            header.length = event.meta.size() + event.jpeg_size;
+            header.crc = event.crc;
+            header.encode(&headers[i * HEADER_SIZE]);
+
+            iov.push_back({&headers[i * HEADER_SIZE], HEADER_SIZE});
+            iov.push_back({const_cast<char *>(event.meta.data()), event.meta.size()});
+            if (event.spool_path.empty()) {
+                iov.push_back({const_cast<unsigned char *>(event.jpeg.data()), event.jpeg.size()});
+            } else {
+                ok = send_iov(iov.data(), iov.size()) && send_file(event.spool_path, event.jpeg_size);
+                iov.clear();
+            }
+            batch[i]->sent = true;
+        }
+        ok = ok && send_iov(iov.data(), iov.size());
+
+        cork = 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        return ok;
+    }
+
+    bool send_iov(struct iovec *iov, size_t count) {
+        while (count > 0) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = std::min<size_t>(count, IOV_MAX);
+            ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                return false;
+            }
+            // Skip what was written, resuming mid-buffer if need be.
+            while (count > 0 && (size_t)n >= iov->iov_len) {
+                n -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+                iov->iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    bool send_file(const std::string &path, size_t size) {
+        int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0) {
+            return false;
+        }
+        off_t offset = 0;
+        while ((size_t)offset < size) {
+            ssize_t n = sendfile(fd, file, &offset, size - offset);
+            if (n <= 0) {
+                break;
+            }
+        }
+        close(file);
+        return (size_t)offset == size;
+    }
+
+    bool read_ack(uint64_t &seq) {
+        uint8_t buffer[HEADER_SIZE];
+        size_t have = 0;
+        while (have < HEADER_SIZE) {
+            ssize_t n = recv(fd, buffer + have, HEADER_SIZE - have, 0);
+            if (n <= 0) {
+                if (n == 0) {
+                    errno = ECONNRESET;
+                }
+                return false;
+            }
+            have += n;
+        }
+        Header header;
+        if (!header.decode(buffer) || header.type != ACK || header.length != 0) {
+            errno = EPROTO;
+            return false;
+        }
+        seq = header.seq;
+        return true;
+    }
+
+    // Drops everything the receiver has; the caller holds the lock.
+    void acknowledge(uint64_t seq) {
+        while (!pending.empty() && pending.front()->seq <= seq) {
+            pending.pop_front();
+            ++acknowledged;
+        }
+    }
+
+    void disconnect() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    UploadSettings settings;
+    int fd = -1;                    // run() thread only
+    std::thread thread;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool running = false;
+    std::deque<std::shared_ptr<Event>> pending;
+    uint64_t last_seq = 0;
+    uint64_t queued = 0;
+    uint64_t acknowledged = 0;
+    uint64_t resent = 0;
+    uint64_t dropped = 0;
+};
+
+} // namespace upload
+
+#endif // UPLOAD_PROTOCOL_H
@@ -0,0 +1,939 @@
+#include <opencv2/opencv.hpp>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/rtsp-server/rtsp-server.h>
+#include <glob.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "color_convert.h"
+#include "detector.h"
+#include "encoder.h"
+#include "metrics.h"
+#include "motion.h"
+#include "rtsp_pool.h"
+
+// Offline benchmarks for wbcam_server. Every mode drives synthetic frames or
+// a recorded clip through the same code the server runs, so no camera is
+// needed.
+//
+//   wbcam_bench encode [--frames N] [--width W] [--height H]
+//   wbcam_bench convert
+//   wbcam_bench motion [--frames N] [--width W] [--height H] [--fps F]
+//   wbcam_bench detect --model FILE --clip FILE [--frames N] [--batch N]
+//   wbcam_bench load [--cameras N] [--clients N] [--decode N] [--seconds N] [--clip FILE]
+//                    [--width W] [--height H] [--fps F] [--multicast]
+//   wbcam_bench sessions [--clients N] [--rtsp-threads N] [--seconds N] [--cameras N]
+
+struct BenchOptions {
+    int frames = 450;
+    int width = 800;
+    int height = 600;
+    int fps = 15;
+    int batch = 4;
+    std::string model;
+    std::string clip;
+    int cameras = 1;
+    int clients = 4;
+    int decode = 1;
+    int seconds = 30;
+    RtspPoolSettings pool;
+    bool multicast = false;
+};
+
+// Process CPU time (user + system) and wall time between start() and stop().
+class CpuTimer {
+public:
+    void start() {
+        cpu_start = cpu_seconds();
+        wall_start = std::chrono::steady_clock::now();
+    }
+
+    void stop() {
+        cpu = cpu_seconds() - cpu_start;
+        wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    }
+
+    double cpu = 0;
+    double wall = 0;
+
+private:
+    static double cpu_seconds() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+               usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    }
+
+    double cpu_start = 0;
+    std::chrono::steady_clock::time_point wall_start;
+};
+
+// A short loop of moving frames, so the encoder has real motion to code.
+static std::vector<cv::Mat> synthetic_frames(const BenchOptions &opts, int count = 30) {
+    std::vector<cv::Mat> frames;
+    for (int i = 0; i < count; ++i) {
+        cv::Mat frame(opts.height, opts.width, CV_8UC3);
+        for (int y = 0; y < opts.height; ++y) {
+            unsigned char *row = frame.ptr(y);
+            for (int x = 0; x < opts.width; ++x) {
+                row[x * 3 + 0] = (unsigned char)(x + i * 4);
+                row[x * 3 + 1] = (unsigned char)(y + i * 2);
+                row[x * 3 + 2] = (unsigned char)((x ^ y) + i);
+            }
+        }
+        int box = opts.height / 6;
+        cv::rectangle(frame, cv::Rect((i * 17) % (opts.width - box), opts.height / 2 - box / 2, box, box),
+                      cv::Scalar(255, 255, 255), cv::FILLED);
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+static GstBuffer *i420_buffer(const cv::Mat &i420, int index, int fps) {
+    gsize size = i420.total() * i420.elemSize();
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    memcpy(map.data, i420.data, size);
+    gst_buffer_unmap(buffer, &map);
+    GST_BUFFER_PTS(buffer) = gst_util_uint64_scale_int(index, GST_SECOND, fps);
+    GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale_int(1, GST_SECOND, fps);
+    return buffer;
+}
+
+static void drain(GstElement *pipeline, GstAppSrc *appsrc) {
+    gst_app_src_end_of_stream(appsrc);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE,
+                                                 (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+}
+
+static void report(const char *mode, const BenchOptions &opts, const CpuTimer &timer) {
+    g_print("%-14s %6d frames  %8.3f ms CPU/frame  %7.1f fps wall\n",
+            mode, opts.frames, timer.cpu * 1000.0 / opts.frames, opts.frames / timer.wall);
+}
+
+// The pre-shared layout: x264enc in the RTSP launch string plus a second
+// encode by cv::VideoWriter for the recording.
+static void bench_double_encode(const BenchOptions &opts, const std::vector<cv::Mat> &frames) {
+    std::ostringstream launch;
+    launch << "appsrc name=raw format=time block=true ! videoconvert ! "
+           << "x264enc tune=zerolatency speed-preset=ultrafast bitrate=2000 key-int-max=15 ! "
+           << "h264parse ! fakesink sync=false";
+    GstElement *pipeline = gst_parse_launch(launch.str().c_str(), NULL);
+    GstAppSrc *appsrc = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(pipeline), "raw"));
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                       "format", G_TYPE_STRING, "I420",
+                                       "width", G_TYPE_INT, opts.width,
+                                       "height", G_TYPE_INT, opts.height,
+                                       "framerate", GST_TYPE_FRACTION, opts.fps, 1,
+                                       NULL);
+    gst_app_src_set_caps(appsrc, caps);
+    gst_caps_unref(caps);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    std::string filename = generate_filename("/tmp/wbcam_bench_double");
+    cv::VideoWriter writer(filename, cv::VideoWriter::fourcc('a', 'v', 'c', '1'), opts.fps,
+                           cv::Size(opts.width, opts.height));
+
+    CpuTimer timer;
+    timer.start();
+    cv::Mat i420;
+    for (int i = 0; i < opts.frames; ++i) {
+        const cv::Mat &bgr = frames[i % frames.size()];
+        cv::cvtColor(bgr, i420, cv::COLOR_BGR2YUV_I420);
+        gst_app_src_push_buffer(appsrc, i420_buffer(i420, i, opts.fps));
+        writer.write(bgr);
+    }
+    drain(pipeline, appsrc);
+    writer.release();
+    timer.stop();
+    report("double-encode", opts, timer);
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(appsrc);
+    gst_object_unref(pipeline);
+    std::remove(filename.c_str());
+}
+
+// The server's layout: one Encoder teeing to the live fan-out and to the
+// mp4mux recording branch.
+static void bench_shared_encode(const BenchOptions &opts, const std::vector<cv::Mat> &frames) {
+    EncoderSettings settings;
+    settings.width = opts.width;
+    settings.height = opts.height;
+    settings.fps = opts.fps;
+    settings.record.prefix = "/tmp/wbcam_bench_shared";
+    settings.live = false;
+
+    Encoder encoder("bench", settings);
+    int samples = 0;
+    encoder.start([&samples](GstSample *) { ++samples; });
+
+    CpuTimer timer;
+    timer.start();
+    cv::Mat i420;
+    for (int i = 0; i < opts.frames; ++i) {
+        cv::cvtColor(frames[i % frames.size()], i420, cv::COLOR_BGR2YUV_I420);
+        gst_app_src_push_buffer(encoder.source(), i420_buffer(i420, i, opts.fps));
+    }
+    encoder.stop();
+    timer.stop();
+    report("shared-encode", opts, timer);
+
+    // The recorder names its segments; remove them and their .idx files.
+    glob_t files;
+    if (glob((settings.record.prefix + "_*").c_str(), 0, NULL, &files) == 0) {
+        for (size_t i = 0; i < files.gl_pathc; ++i) {
+            std::remove(files.gl_pathv[i]);
+        }
+    }
+    globfree(&files);
+}
+
+static int bench_encode(const BenchOptions &opts) {
+    std::vector<cv::Mat> frames = synthetic_frames(opts);
+    g_print("Encoding %dx%d@%d, CPU time is for the whole process\n", opts.width, opts.height, opts.fps);
+    bench_double_encode(opts, frames);
+    bench_shared_encode(opts, frames);
+    return 0;
+}
+
+// Runs `body` until at least half a second has passed and prints a line in
+// the Google Benchmark console format: per-iteration wall time, CPU time and
+// the iteration count.
+static void run_timed(const std::string &name, double pixels, const std::function<void()> &body) {
+    CpuTimer timer;
+    long iterations = 0;
+    timer.start();
+    do {
+        for (int i = 0; i < 16; ++i) {
+            body();
+        }
+        iterations += 16;
+        timer.stop();
+    } while (timer.wall < 0.5);
+    g_print("%-28s %10.0f ns %10.0f ns %10ld  %.1fM pixels/s\n", name.c_str(),
+            timer.wall * 1e9 / iterations, timer.cpu * 1e9 / iterations, iterations,
+            pixels * iterations / timer.wall / 1e6);
+}
+
+// BGR -> I420 conversion done once per captured frame: cv::cvtColor against
+// the kernel the capture thread uses, and the largest per-sample difference.
+static int bench_convert(const BenchOptions &) {
+    const cv::Size sizes[] = {cv::Size(640, 480), cv::Size(800, 600), cv::Size(1280, 720), cv::Size(1920, 1080)};
+    g_print("bgr_to_i420 kernel: %s\n", color_convert::kernel_name());
+    g_print("%-28s %13s %13s %10s\n", "Benchmark", "Time", "CPU", "Iterations");
+    for (const cv::Size &size : sizes) {
+        BenchOptions opts;
+        opts.width = size.width;
+        opts.height = size.height;
+        cv::Mat bgr = synthetic_frames(opts, 1)[0];
+        cv::Mat reference, i420;
+        std::string suffix = "/" + std::to_string(size.width) + "x" + std::to_string(size.height);
+        double pixels = (double)size.width * size.height;
+
+        run_timed("BM_cvtColor" + suffix, pixels, [&] { cv::cvtColor(bgr, reference, cv::COLOR_BGR2YUV_I420); });
+        run_timed("BM_bgr_to_i420" + suffix, pixels, [&] { bgr_to_i420(bgr, i420); });
+
+        int max_diff = 0;
+        for (size_t i = 0; i < reference.total(); ++i) {
+            max_diff = std::max(max_diff, std::abs(reference.data[i] - i420.data[i]));
+        }
+        g_print("%-28s max difference %d\n", ("  " + suffix.substr(1)).c_str(), max_diff);
+    }
+    return 0;
+}
+
+// Encodes a mostly static scene, with two seconds of motion at the start of
+// every 30, either frame by frame or through the MotionGate the server uses.
+static void bench_gated_encode(const BenchOptions &opts, const std::vector<cv::Mat> &i420_frames, bool gated) {
+    EncoderSettings settings;
+    settings.width = opts.width;
+    settings.height = opts.height;
+    settings.fps = opts.fps;
+    settings.live = false;
+
+    Encoder encoder("bench", settings);
+    int samples = 0;
+    encoder.start([&samples](GstSample *) { ++samples; });
+    MotionSettings motion_settings;
+    motion_settings.enabled = true;
+    MotionGate gate(opts.width, opts.height, motion_settings);
+
+    CpuTimer timer;
+    timer.start();
+    for (int i = 0; i < opts.frames; ++i) {
+        bool moving = i % (30 * opts.fps) < 2 * opts.fps;
+        const cv::Mat &i420 = i420_frames[moving ? i % i420_frames.size() : 0];
+        GstClockTime time = gst_util_uint64_scale_int(i, GST_SECOND, opts.fps);
+        if (gated && !gate.admit(i420.data, i420.cols, time)) {
+            continue;
+        }
+        gst_app_src_push_buffer(encoder.source(), i420_buffer(i420, i, opts.fps));
+    }
+    encoder.stop();
+    timer.stop();
+    report(gated ? "motion-gated" : "every-frame", opts, timer);
+    g_print("%-14s %6d frames encoded\n", "", samples);
+}
+
+static int bench_motion(const BenchOptions &opts) {
+    std::vector<cv::Mat> i420_frames;
+    for (const cv::Mat &bgr : synthetic_frames(opts)) {
+        cv::Mat i420;
+        bgr_to_i420(bgr, i420);
+        i420_frames.push_back(i420);
+    }
+    g_print("Encoding a mostly static %dx%d@%d scene, CPU time is for the whole process\n",
+            opts.width, opts.height, opts.fps);
+    bench_gated_encode(opts, i420_frames, false);
+    bench_gated_encode(opts, i420_frames, true);
+    return 0;
+}
+
+// Detection throughput on a recorded clip: frames are decoded and scaled
+// to the tap size up front, so only the detector is timed. Frames/s per core
+// divides by the CPU time, since the DNN backend spreads over all cores.
+static int bench_detect(const BenchOptions &opts) {
+    if (opts.model.empty() || opts.clip.empty()) {
+        std::cerr << "detect needs --model and --clip" << std::endl;
+        return -1;
+    }
+
+    cv::VideoCapture clip(opts.clip);
+    std::vector<cv::Mat> frames;
+    cv::Mat frame;
+    while ((int)frames.size() < opts.frames && clip.read(frame)) {
+        cv::Mat scaled;
+        cv::resize(frame, scaled, cv::Size(frame.cols / 2, frame.rows / 2), 0, 0, cv::INTER_AREA);
+        frames.push_back(scaled);
+    }
+    if (frames.empty()) {
+        std::cerr << "Could not read frames from " << opts.clip << std::endl;
+        return -1;
+    }
+
+    DetectorSettings settings;
+    settings.model = opts.model;
+    Detector detector(settings);
+    if (!detector.load()) {
+        return -1;
+    }
+
+    g_print("Detecting on %zu frames of %s, %dx%d\n", frames.size(), opts.clip.c_str(), frames[0].cols, frames[0].rows);
+    for (int batch_size = 1; batch_size <= opts.batch; batch_size *= 2) {
+        size_t detections = 0;
+        CpuTimer timer;
+        timer.start();
+        for (size_t i = 0; i < frames.size(); i += batch_size) {
+            std::vector<cv::Mat> batch(frames.begin() + i, frames.begin() + std::min(frames.size(), i + batch_size));
+            for (const auto &result : detector.detect(batch)) {
+                detections += result.size();
+            }
+        }
+        timer.stop();
+        g_print("batch %-3d %8.1f frames/s  %8.1f frames/s per core  %zu detections\n", batch_size,
+                frames.size() / timer.wall, frames.size() / timer.cpu, detections);
+    }
+    return 0;
+}
+
+// Load test frame stamp: the capture time in milliseconds as 32 black or
+// white 16x16 blocks along the top edge, after a white and before a black
+// guard block. Flat blocks that size come through H.264 intact, so a client
+// reads the time back from the decoded luma.
+static const int STAMP_BLOCK = 16;
+static const int STAMP_BITS = 32;
+
+static uint32_t stamp_clock_ms() {
+    return (uint32_t)(metrics::now_ns() / 1000000);
+}
+
+static void stamp_frame(cv::Mat &bgr, uint32_t ms) {
+    for (int b = 0; b < STAMP_BITS + 2; ++b) {
+        bool white = b == 0 || (b <= STAMP_BITS && ((ms >> (b - 1)) & 1));
+        cv::rectangle(bgr, cv::Rect(b * STAMP_BLOCK, 0, STAMP_BLOCK, STAMP_BLOCK),
+                      white ? cv::Scalar(255, 255, 255) : cv::Scalar(0, 0, 0), cv::FILLED);
+    }
+}
+
+static bool read_stamp(const uint8_t *y, int stride, uint32_t &ms) {
+    // Only the middle of each block, away from ringing at its edges.
+    auto white = [y, stride](int block) {
+        int sum = 0;
+        for (int dy = 4; dy < 12; ++dy) {
+            for (int dx = 4; dx < 12; ++dx) {
+                sum += y[dy * stride + block * STAMP_BLOCK + dx];
+            }
+        }
+        return sum / 64 > 128;
+    };
+    if (!white(0) || white(STAMP_BITS + 1)) {
+        return false;
+    }
+    ms = 0;
+    for (int b = 0; b < STAMP_BITS; ++b) {
+        if (white(b + 1)) {
+            ms |= 1u << b;
+        }
+    }
+    return true;
+}
+
+// One in-process RTSP viewer. Decoding clients read the stamp of every
+// frame for the glass-to-glass latency; the others only depayload, so that
+// the process CPU stays mostly the server's.
+struct LoadClient {
+    GstElement *pipeline = nullptr;
+    bool decode = false;
+    std::atomic<metrics::Histogram *> latency{nullptr};     // may be switched while playing
+    std::atomic<guint64> frames{0};
+    std::atomic<guint64> unreadable{0};
+
+    static GstFlowReturn new_sample(GstAppSink *sink, gpointer user_data) {
+        LoadClient *client = static_cast<LoadClient *>(user_data);
+        GstSample *sample = gst_app_sink_pull_sample(sink);
+        if (!sample) {
+            return GST_FLOW_EOS;
+        }
+        client->frames.fetch_add(1, std::memory_order_relaxed);
+        if (client->decode) {
+            GstStructure *caps = gst_caps_get_structure(gst_sample_get_caps(sample), 0);
+            int width = 0;
+            gst_structure_get_int(caps, "width", &width);
+            GstBuffer *buffer = gst_sample_get_buffer(sample);
+            GstMapInfo map;
+            uint32_t stamp;
+            if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+                // I420 from the decoder: the Y plane comes first, rows padded to 4.
+                if (read_stamp(map.data, (width + 3) & ~3, stamp)) {
+                    client->latency.load()->record((guint64)(uint32_t)(stamp_clock_ms() - stamp) * 1000000);
+                } else {
+                    client->unreadable.fetch_add(1, std::memory_order_relaxed);
+                }
+                gst_buffer_unmap(buffer, &map);
+            }
+        }
+        gst_sample_unref(sample);
+        return GST_FLOW_OK;
+    }
+};
+
+static guint64 resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    guint64 pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+struct LoadRun {
+    const BenchOptions *opts;
+    GMainLoop *loop;
+    std::vector<std::unique_ptr<LoadClient>> *clients;
+    metrics::Histogram *latency;
+    CpuTimer interval;
+    std::vector<guint64> last_frames;
+    double elapsed = 0;
+};
+
+static gboolean load_sample(gpointer user_data) {
+    LoadRun *run = static_cast<LoadRun *>(user_data);
+    run->interval.stop();
+    run->elapsed += run->interval.wall;
+
+    guint64 frames = 0, slowest = G_MAXUINT64;
+    for (size_t i = 0; i < run->clients->size(); ++i) {
+        guint64 total = (*run->clients)[i]->frames.load();
+        guint64 delta = total - run->last_frames[i];
+        run->last_frames[i] = total;
+        frames += delta;
+        slowest = std::min(slowest, delta);
+    }
+    double clients = run->clients->size();
+    g_print("%6.0f s  %7.1f fps/client (slowest %5.1f)  latency p50 %6.1f ms p99 %6.1f ms  "
+            "CPU %5.1f %% per camera  RSS %6.1f MiB\n",
+            run->elapsed, frames / clients / run->interval.wall, slowest / run->interval.wall,
+            run->latency->quantile(0.5) / 1e6, run->latency->quantile(0.99) / 1e6,
+            run->interval.cpu / run->interval.wall * 100 / run->opts->cameras, resident_bytes() / 1048576.0);
+    run->interval.start();
+
+    if (run->elapsed >= run->opts->seconds) {
+        g_main_loop_quit(run->loop);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Cameras fed by videotestsrc or a clip, with stamped frames, behind an RTSP
+// server on a free port: wbcam_server in one process.
+struct BenchServer {
+    std::vector<std::unique_ptr<Camera>> cameras;
+    GstRTSPServer *server = nullptr;
+    MulticastTransport multicast;
+    guint source = 0;
+    int port = 0;
+
+    bool start(const BenchOptions &opts) {
+        if (opts.width < (STAMP_BITS + 2) * STAMP_BLOCK || opts.cameras < 1) {
+            std::cerr << "Needs --width of at least " << (STAMP_BITS + 2) * STAMP_BLOCK
+                      << " and one camera" << std::endl;
+            return false;
+        }
+        for (int i = 0; i < opts.cameras; ++i) {
+            CameraConfig config;
+            config.name = "cam" + std::to_string(i);
+            config.source = opts.clip.empty() ? "videotestsrc" : opts.clip;
+            config.width = opts.width;
+            config.height = opts.height;
+            config.fps = opts.fps;
+            config.format_set = true;
+            std::unique_ptr<Camera> camera(new Camera(config));
+            if (!camera->open()) {
+                return false;
+            }
+            camera->set_frame_hook([](cv::Mat &bgr) { stamp_frame(bgr, stamp_clock_ms()); });
+            cameras.push_back(std::move(camera));
+        }
+
+        server = gst_rtsp_server_new();
+        g_object_set(server, "service", "0", NULL);
+        configure_rtsp_server(server, opts.pool);
+        MulticastSettings multicast_settings;
+        multicast_settings.enabled = opts.multicast;
+        multicast_settings.unicast_fallback = true;     // the session storm uses TCP
+        if (!multicast.configure(multicast_settings)) {
+            return false;
+        }
+        GstRTSPMountPoints *mounts = gst_rtsp_server_get_mount_points(server);
+        for (auto &camera : cameras) {
+            camera->mount(mounts, &multicast);
+        }
+        g_object_unref(mounts);
+        source = gst_rtsp_server_attach(server, NULL);
+        port = gst_rtsp_server_get_bound_port(server);
+
+        for (auto &camera : cameras) {
+            if (!camera->start()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void stop() {
+        if (source) {
+            g_source_remove(source);
+            source = 0;
+        }
+        for (auto &camera : cameras) {
+            camera->stop();
+        }
+        if (server) {
+            g_object_unref(server);
+            server = nullptr;
+        }
+    }
+};
+
+// An rtspsrc viewer of /cam<camera>; decoding ones record the latency.
+static LoadClient *start_client(int port, int camera, bool decode, bool multicast, metrics::Histogram *latency) {
+    std::unique_ptr<LoadClient> client(new LoadClient());
+    client->decode = decode;
+    client->latency = latency;
+
+    std::ostringstream launch;
+    launch << "rtspsrc location=rtsp://127.0.0.1:" << port << "/cam" << camera << " latency=0 "
+           << (multicast ? "protocols=udp-mcast ! " : "! ")
+           << "rtph264depay ! ";
+    if (decode) {
+        launch << "avdec_h264 ! videoconvert ! video/x-raw,format=I420 ! ";
+    } else {
+        launch << "video/x-h264,alignment=au ! ";
+    }
+    launch << "appsink name=sink sync=false max-buffers=4 drop=true";
+
+    GError *error = nullptr;
+    client->pipeline = gst_parse_launch(launch.str().c_str(), &error);
+    if (!client->pipeline) {
+        g_printerr("Failed to create client: %s\n", error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return nullptr;
+    }
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(client->pipeline), "sink");
+    GstAppSinkCallbacks callbacks = {};
+    callbacks.new_sample = LoadClient::new_sample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, client.get(), NULL);
+    gst_object_unref(sink);
+    gst_element_set_state(client->pipeline, GST_STATE_PLAYING);
+    return client.release();
+}
+
+static void stop_client(LoadClient *client) {
+    gst_element_set_state(client->pipeline, GST_STATE_NULL);
+    gst_object_unref(client->pipeline);
+}
+
+// The whole server in one process with --clients rtspsrc viewers spread over
+// the cameras. Latency is capture to decoded frame, read from the stamp.
+static int bench_load(const BenchOptions &opts) {
+    if (opts.clients < 1) {
+        std::cerr << "load needs at least one client" << std::endl;
+        return -1;
+    }
+    BenchServer server;
+    if (!server.start(opts)) {
+        return -1;
+    }
+
+    metrics::Histogram latency;
+    std::vector<std::unique_ptr<LoadClient>> clients;
+    for (int i = 0; i < opts.clients; ++i) {
+        LoadClient *client = start_client(server.port, i % opts.cameras, i < opts.decode, opts.multicast, &latency);
+        if (!client) {
+            return -1;
+        }
+        clients.emplace_back(client);
+    }
+
+    g_print("%d camera(s) %dx%d@%d from %s, %d %s client(s), %d decoding; CPU is the whole process\n",
+            opts.cameras, opts.width, opts.height, opts.fps, opts.clip.empty() ? "videotestsrc" : opts.clip.c_str(),
+            opts.clients, opts.multicast ? "multicast" : "unicast", std::min(opts.decode, opts.clients));
+    guint64 rss_start = resident_bytes();
+    CpuTimer total;
+    total.start();
+
+    LoadRun run;
+    run.opts = &opts;
+    run.loop = g_main_loop_new(NULL, FALSE);
+    run.clients = &clients;
+    run.latency = &latency;
+    run.last_frames.assign(clients.size(), 0);
+    run.interval.start();
+    g_timeout_add_seconds(5, load_sample, &run);
+    g_main_loop_run(run.loop);
+    total.stop();
+
+    guint64 frames = 0, unreadable = 0;
+    for (auto &client : clients) {
+        frames += client->frames.load();
+        unreadable += client->unreadable.load();
+        stop_client(client.get());
+    }
+    g_print("sustained %.1f fps/client, latency p50 %.1f ms p90 %.1f ms p99 %.1f ms (%" G_GUINT64_FORMAT
+            " frames, %" G_GUINT64_FORMAT " unreadable stamps), CPU %.1f %% per camera, RSS %.1f -> %.1f MiB\n",
+            frames / (double)clients.size() / total.wall, latency.quantile(0.5) / 1e6, latency.quantile(0.9) / 1e6,
+            latency.quantile(0.99) / 1e6, latency.count(), unreadable,
+            total.cpu / total.wall * 100 / opts.cameras, rss_start / 1048576.0, resident_bytes() / 1048576.0);
+
+    server.stop();
+    g_main_loop_unref(run.loop);
+    return 0;
+}
+
+// A bare RTSP viewer for the connection storm: OPTIONS, DESCRIBE, SETUP
+// with RTP interleaved on the RTSP connection, PLAY, then it reads and
+// discards the stream. Nothing is depayloaded, so a thousand of them cost
+// next to nothing beside the server.
+class RawRtspSession {
+public:
+    ~RawRtspSession() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Connects and plays; false if any step failed or took over 10 s.
+    bool play(int port, const std::string &path) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct timeval timeout = {10, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            return false;
+        }
+
+        std::string url = "rtsp://127.0.0.1:" + std::to_string(port) + path;
+        std::string reply;
+        if (!request("OPTIONS", url, "", reply) ||
+            !request("DESCRIBE", url, "Accept: application/sdp\r\n", reply)) {
+            return false;
+        }
+        std::string base = header(reply, "Content-Base");
+        size_t control = reply.find("m=video");
+        control = control == std::string::npos ? control : reply.find("a=control:", control);
+        if (control == std::string::npos) {
+            return false;
+        }
+        std::string track = reply.substr(control + 10, reply.find_first_of("\r\n", control) - control - 10);
+        if (track.compare(0, 7, "rtsp://") != 0) {
+            track = (base.empty() ? url + "/" : base) + track;
+        }
+
+        if (!request("SETUP", track, "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n", reply)) {
+            return false;
+        }
+        std::string session = header(reply, "Session");
+        session = session.substr(0, session.find(';'));
+        return request("PLAY", url, "Session: " + session + "\r\nRange: npt=0-\r\n", reply);
+    }
+
+    // Reads until `stop`; true if the server kept sending.
+    bool drain(const std::atomic<bool> &stop) {
+        char chunk[16 * 1024];
+        guint64 received = 0;
+        while (!stop) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 200) > 0) {
+                ssize_t n = read(fd, chunk, sizeof(chunk));
+                if (n <= 0) {
+                    return false;
+                }
+                received += n;
+            }
+        }
+        return received > 0;
+    }
+
+private:
+    bool request(const std::string &method, const std::string &url, const std::string &headers, std::string &reply) {
+        std::string message = method + " " + url + " RTSP/1.0\r\nCSeq: " + std::to_string(++cseq) + "\r\n" +
+                              "User-Agent: wbcam_bench\r\n" + headers + "\r\n";
+        if (send(fd, message.data(), message.size(), MSG_NOSIGNAL) != (ssize_t)message.size()) {
+            return false;
+        }
+        for (;;) {
+            size_t end = pending.find("\r\n\r\n");
+            if (end != std::string::npos) {
+                std::string length = header(pending.substr(0, end + 2), "Content-Length");
+                size_t total = end + 4 + (length.empty() ? 0 : std::strtoul(length.c_str(), nullptr, 10));
+                if (pending.size() >= total) {
+                    reply = pending.substr(0, total);
+                    pending.erase(0, total);
+                    return reply.compare(0, 12, "RTSP/1.0 200") == 0;
+                }
+            }
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                return false;
+            }
+            pending.append(chunk, n);
+        }
+    }
+
+    static std::string header(const std::string &reply, const std::string &name) {
+        size_t start = reply.find("\r\n" + name + ":");
+        if (start == std::string::npos) {
+            return "";
+        }
+        start = reply.find_first_not_of(' ', start + name.size() + 3);
+        return reply.substr(start, reply.find("\r\n", start) - start);
+    }
+
+    int fd = -1;
+    int cseq = 0;
+    std::string pending;
+};
+
+struct StormRun {
+    const BenchOptions *opts;
+    int port;
+    GMainLoop *loop;
+    LoadClient *monitor;
+    metrics::Histogram idle_latency;
+    metrics::Histogram storm_latency;
+    metrics::Histogram setup;
+    double idle_fps = 0;
+    double storm_fps = 0;
+    std::atomic<int> failed{0};
+    std::atomic<int> starved{0};
+};
+
+// Runs next to the main loop: five quiet seconds with only the monitor
+// viewer, then --clients sessions set up all at once and held for --seconds.
+static void run_storm(StormRun *run) {
+    const BenchOptions &opts = *run->opts;
+    auto phase_fps = [run](std::chrono::seconds length) {
+        guint64 start = run->monitor->frames.load();
+        std::this_thread::sleep_for(length);
+        return (run->monitor->frames.load() - start) / (double)length.count();
+    };
+    std::this_thread::sleep_for(std::chrono::seconds(2));    // let the monitor start
+    run->idle_fps = phase_fps(std::chrono::seconds(5));
+
+    run->monitor->latency = &run->storm_latency;
+    std::atomic<bool> go{false};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> sessions;
+    for (int i = 0; i < opts.clients; ++i) {
+        sessions.emplace_back([run, i, &go, &stop] {
+            while (!go) {
+                std::this_thread::yield();
+            }
+            RawRtspSession session;
+            uint64_t start = metrics::now_ns();
+            if (!session.play(run->port, "/cam" + std::to_string(i % run->opts->cameras))) {
+                run->failed.fetch_add(1);
+                return;
+            }
+            run->setup.record_since(start);
+            if (!session.drain(stop)) {
+                run->starved.fetch_add(1);
+            }
+        });
+    }
+    go = true;
+    run->storm_fps = phase_fps(std::chrono::seconds(opts.seconds));
+    stop = true;
+    for (std::thread &session : sessions) {
+        session.join();
+    }
+    g_main_loop_quit(run->loop);
+}
+
+// Session setup under a connection storm, and what it does to a viewer
+// that was already watching.
+static int bench_sessions(const BenchOptions &opts) {
+    BenchServer server;
+    if (!server.start(opts)) {
+        return -1;
+    }
+
+    StormRun run;
+    run.opts = &opts;
+    run.port = server.port;
+    run.loop = g_main_loop_new(NULL, FALSE);
+    run.monitor = start_client(server.port, 0, true, opts.multicast, &run.idle_latency);
+    if (!run.monitor) {
+        return -1;
+    }
+
+    g_print("%d camera(s) %dx%d@%d, %d RTSP thread(s), storm of %d sessions held %d s\n",
+            opts.cameras, opts.width, opts.height, opts.fps, opts.pool.threads, opts.clients, opts.seconds);
+    std::thread storm(run_storm, &run);
+    g_main_loop_run(run.loop);
+    storm.join();
+
+    g_print("session setup   %d ok, %d failed, %d stalled; p50 %.1f ms p90 %.1f ms p99 %.1f ms max %.1f ms\n",
+            (int)run.setup.count(), run.failed.load(), run.starved.load(), run.setup.quantile(0.5) / 1e6,
+            run.setup.quantile(0.9) / 1e6, run.setup.quantile(0.99) / 1e6, run.setup.quantile(1.0) / 1e6);
+    g_print("viewer, idle    %5.1f fps, latency p50 %.1f ms p99 %.1f ms\n", run.idle_fps,
+            run.idle_latency.quantile(0.5) / 1e6, run.idle_latency.quantile(0.99) / 1e6);
+    g_print("viewer, storm   %5.1f fps, latency p50 %.1f ms p99 %.1f ms\n", run.storm_fps,
+            run.storm_latency.quantile(0.5) / 1e6, run.storm_latency.quantile(0.99) / 1e6);
+
+    stop_client(run.monitor);
+    delete run.monitor;
+    server.stop();
+    g_main_loop_unref(run.loop);
+    return 0;
+}
+
+static void print_usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " MODE [--frames N] [--width W] [--height H] [--fps F]" << std::endl
+              << "          [--model FILE] [--clip FILE] [--batch N]" << std::endl
+              << "          [--cameras N] [--clients N] [--decode N] [--seconds N] [--rtsp-threads N]" << std::endl
+              << "          [--multicast]" << std::endl
+              << "Modes:" << std::endl
+              << "  encode    CPU per frame, double encode (RTSP + VideoWriter) vs shared encode" << std::endl
+              << "  motion    CPU per frame on an idle scene, every frame encoded vs motion gated" << std::endl
+              << "  detect    detector frames/s per core on a recorded clip, batch 1 up to --batch" << std::endl
+              << "  convert   BGR to I420 time, cv::cvtColor vs bgr_to_i420 at 480p to 1080p" << std::endl
+              << "  load      the server in-process with --clients RTSP viewers on --cameras synthetic" << std::endl
+              << "            (or --clip) sources: fps, capture-to-display latency, CPU and memory;" << std::endl
+              << "            with --multicast the viewers join the mounts' multicast groups" << std::endl
+              << "  sessions  setup latency of --clients RTSP sessions opened at once, and the fps and" << std::endl
+              << "            latency of a viewer already watching, before and during the storm" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    gst_init(&argc, &argv);
+
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    BenchOptions opts;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--multicast") {
+            opts.multicast = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        const char *option = argv[++i];
+        int value = std::atoi(option);
+        if (arg == "--model") {
+            opts.model = option;
+        } else if (arg == "--clip") {
+            opts.clip = option;
+        } else if (arg == "--cameras") {
+            opts.cameras = value;
+        } else if (arg == "--clients") {
+            opts.clients = value;
+        } else if (arg == "--decode") {
+            opts.decode = value;
+        } else if (arg == "--seconds") {
+            opts.seconds = value;
+        } else if (arg == "--rtsp-threads") {
+            opts.pool.threads = value;
+        } else if (arg == "--batch") {
+            opts.batch = value;
+        } else if (arg == "--frames") {
+            opts.frames = value;
+        } else if (arg == "--width") {
+            opts.width = value;
+        } else if (arg == "--height") {
+            opts.height = value;
+        } else if (arg == "--fps") {
+            opts.fps = value;
+        } else {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    std::map<std::string, std::function<int(const BenchOptions &)>> modes = {
+        {"encode", bench_encode},
+        {"convert", bench_convert},
+        {"motion", bench_motion},
+        {"detect", bench_detect},
+        {"load", bench_load},
+        {"sessions", bench_sessions},
+    };
+    auto mode = modes.find(argv[1]);
+    if (mode == modes.end()) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    return mode->second(opts);
+}
@@ -0,0 +1,210 @@
+#include <opencv2/opencv.hpp>
+#include <gst/gst.h>
+#include <poll.h>
+#include <signal.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "detector.h"
+#include "event_dispatcher.h"
+#include "frame_tap.h"
+
+// Object detection for wbcam_server, next to it on the same box. Frames come
+// from the server's frame taps (wbcam_server --tap), already downscaled BGR,
+// so nothing is decoded. The newest frame of every camera that has one goes
+// into a single batched forward pass, and detections are handed to the event
+// dispatcher, whose sinks run on their own threads, so a slow alarm never
+// holds up inference.
+
+static std::atomic<bool> running{true};
+
+static void handle_signal(int) {
+    running = false;
+}
+
+static void print_usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " --model FILE [OPTIONS] [CAMERA...]" << std::endl
+              << "  CAMERA is a mount name of wbcam_server --tap (default cam0)." << std::endl
+              << "  --model FILE          YOLOv8 ONNX export (dynamic=True for --batch > 1)" << std::endl
+              << "  --labels FILE         class names, one per line" << std::endl
+              << "  --batch N             most frames per forward pass (default 4)" << std::endl
+              << "  --size N              network input size (default 640)" << std::endl
+              << "  --conf F              confidence threshold (default 0.5)" << std::endl
+              << "  --nms F               NMS IoU threshold (default 0.45)" << std::endl
+              << "  --tap-socket PATH     wbcam_server tap socket (default /tmp/wbcam_tap.sock)" << std::endl
+              << "  --event-socket PATH   wbcam_server trigger socket (default /tmp/wbcam_events.sock)" << std::endl
+              << "  --cooldown N          seconds between events per camera and class (default 10)" << std::endl
+              << "  --camera-interval MS  milliseconds between events per camera (default 1000)" << std::endl
+              << "  --gpio PATH           pulse this GPIO value file on events, e.g. /sys/class/gpio/gpio14/value" << std::endl
+              << "  --upload HOST:PORT    send a JPEG snapshot of every event to event_receiver" << std::endl
+              << "  --spool DIR           keep snapshots waiting for upload in DIR instead of memory" << std::endl
+              << "  --snapshots DIR       save event snapshots and events.log in DIR" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    DetectorSettings settings;
+    std::string tap_socket = "/tmp/wbcam_tap.sock";
+    std::string event_socket = "/tmp/wbcam_events.sock";
+    DispatchSettings dispatch;
+    std::string gpio;
+    std::string upload;
+    upload::UploadSettings upload_settings;
+    std::string snapshots;
+    std::vector<std::string> cameras;
+    // std::stoi and friends throw on a malformed number.
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--model" && has_value) {
+                settings.model = argv[++i];
+            } else if (arg == "--labels" && has_value) {
+                settings.labels = argv[++i];
+            } else if (arg == "--batch" && has_value) {
+                settings.batch = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--size" && has_value) {
+                settings.input_size = std::stoi(argv[++i]);
+            } else if (arg == "--conf" && has_value) {
+                settings.confidence = std::stof(argv[++i]);
+            } else if (arg == "--nms" && has_value) {
+                settings.nms = std::stof(argv[++i]);
+            } else if (arg == "--tap-socket" && has_value) {
+                tap_socket = argv[++i];
+            } else if (arg == "--event-socket" && has_value) {
+                event_socket = argv[++i];
+            } else if (arg == "--cooldown" && has_value) {
+                dispatch.class_interval = std::chrono::seconds(std::stoi(argv[++i]));
+            } else if (arg == "--camera-interval" && has_value) {
+                dispatch.camera_interval = std::chrono::milliseconds(std::stoi(argv[++i]));
+            } else if (arg == "--gpio" && has_value) {
+                gpio = argv[++i];
+            } else if (arg == "--upload" && has_value) {
+                upload = argv[++i];
+            } else if (arg == "--spool" && has_value) {
+                upload_settings.spool = argv[++i];
+            } else if (arg == "--snapshots" && has_value) {
+                snapshots = argv[++i];
+            } else if (arg.compare(0, 2, "--") == 0) {
+                print_usage(argv[0]);
+                return arg == "--help" ? 0 : -1;
+            } else {
+                cameras.push_back(arg);
+            }
+        }
+    } catch (const std::exception &) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (settings.model.empty()) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (cameras.empty()) {
+        cameras.push_back("cam0");
+    }
+    size_t colon = upload.rfind(':');
+    char *port_end = nullptr;
+    long upload_port = colon == std::string::npos ? 0 : std::strtol(upload.c_str() + colon + 1, &port_end, 10);
+    if (!upload.empty() && (colon == std::string::npos || colon == 0 || *port_end || upload_port <= 0 ||
+                            upload_port > 65535)) {
+        std::cerr << "Error: --upload needs HOST:PORT" << std::endl;
+        return -1;
+    }
+
+    Detector detector(settings);
+    if (!detector.load()) {
+        return -1;
+    }
+
+    std::vector<std::unique_ptr<TapReader>> taps;
+    for (const std::string &camera : cameras) {
+        std::unique_ptr<TapReader> tap(new TapReader());
+        if (!tap->open(tap_socket, camera)) {
+            return -1;
+        }
+        g_print("Reading %s from the frame tap (%dx%d)\n", camera.c_str(), tap->get_width(), tap->get_height());
+        taps.push_back(std::move(tap));
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    EventDispatcher events(dispatch);
+    events.add_sink(new RecordingSink(event_socket));
+    if (!gpio.empty()) {
+        events.add_sink(new GpioSink(gpio));
+    }
+    if (!upload.empty()) {
+        char host[256] = "wbcam";
+        gethostname(host, sizeof(host) - 1);
+        upload_settings.host = upload.substr(0, colon);
+        upload_settings.port = upload_port;
+        upload_settings.sender = std::string(host) + "-" + std::to_string(getpid()) + "-" + std::to_string(time(NULL));
+        events.add_sink(new UploadSink(upload_settings));
+    }
+    if (!snapshots.empty()) {
+        events.add_sink(new FileSink(snapshots));
+    }
+    events.start();
+
+    std::vector<cv::Mat> latest(taps.size());
+    std::vector<bool> fresh(taps.size(), false);
+    size_t next_camera = 0;     // round robin when there are more cameras than batch slots
+    guint64 frames = 0;
+    auto stats_start = std::chrono::steady_clock::now();
+
+    while (running) {
+        std::vector<struct pollfd> fds;
+        for (auto &tap : taps) {
+            fds.push_back({tap->get_event_fd(), POLLIN, 0});
+        }
+        if (poll(fds.data(), fds.size(), 1000) <= 0) {
+            continue;
+        }
+        for (size_t i = 0; i < taps.size(); ++i) {
+            if ((fds[i].revents & POLLIN) && taps[i]->read_latest(latest[i])) {
+                fresh[i] = true;
+            }
+        }
+
+        std::vector<cv::Mat> batch;
+        std::vector<size_t> sources;
+        for (size_t n = 0; n < taps.size() && (int)batch.size() < settings.batch; ++n) {
+            size_t i = (next_camera + n) % taps.size();
+            if (fresh[i]) {
+                batch.push_back(latest[i]);
+                sources.push_back(i);
+                fresh[i] = false;
+            }
+        }
+        if (batch.empty()) {
+            continue;
+        }
+        next_camera = (sources.back() + 1) % taps.size();
+
+        std::vector<std::vector<Detection>> results = detector.detect(batch);
+        for (size_t b = 0; b < results.size(); ++b) {
+            const std::string &camera = cameras[sources[b]];
+            for (const Detection &detection : results[b]) {
+                std::string label = detector.class_name(detection.class_id);
+                if (events.post(camera, label, detection.confidence, batch[b], detection.box)) {
+                    g_print("[%s] detected %s %.2f\n", camera.c_str(), label.c_str(), detection.confidence);
+                }
+            }
+        }
+
+        frames += batch.size();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats_start).count();
+        if (elapsed >= 30) {
+            g_print("Detected on %" G_GUINT64_FORMAT " frames, %.1f frames/s\n", frames, frames / elapsed);
+            events.print_stats();
+            frames = 0;
+            stats_start = std::chrono::steady_clock::now();
+        }
+    }
+    return 0;
+}
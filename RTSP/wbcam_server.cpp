@@ -1,200 +1,354 @@
 #include <opencv2/opencv.hpp>
 #include <gst/gst.h>
-#include <gst/app/gstappsrc.h>
 #include <gst/rtsp-server/rtsp-server.h>
-#include <thread>
 #include <atomic>
-#include <chrono>
-#include <ctime>
-#include <iomanip>
-#include <sstream>
-#include <mutex>
-#include <condition_variable>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "camera.h"
+#include "frame_tap.h"
+#include "metrics.h"
+#include "rtsp_pool.h"
+#include "trigger_server.h"
 
 static GMainLoop *loop;
-static std::atomic<bool> is_running(true);
-static std::mutex frame_mutex;
-static std::condition_variable frame_cv;
-static cv::Mat latest_frame;
-static bool new_frame_available = false;
-static GstAppSrc *appsrc = nullptr;
-static GstClockTime timestamp = 0;
-
-std::string generate_filename() {
-    auto now = std::chrono::system_clock::now();
-    std::time_t time = std::chrono::system_clock::to_time_t(now);
-    std::tm *ltm = std::localtime(&time);
-    char filename[100];
-    std::strftime(filename, sizeof(filename), "%Y-%m-%d_%H-%M-%S.mp4", ltm);
-    return std::string(filename);
-}
+static std::atomic<int> rtsp_clients{0};
 
-static void need_data(GstElement *appsrc, guint unused, gpointer user_data) {
-    std::lock_guard<std::mutex> lock(frame_mutex);
-    if (!latest_frame.empty()) {
-        cv::Mat yuv_frame;
-        cv::cvtColor(latest_frame, yuv_frame, cv::COLOR_BGR2YUV_I420);
-        
-        GstBuffer *buffer = gst_buffer_new_allocate(NULL, yuv_frame.total(), NULL);
-        if (!buffer) {
-            g_print("Failed to create buffer\n");
-            return;
-        }
+static void client_closed(GstRTSPClient *client, gpointer user_data) {
+    rtsp_clients.fetch_sub(1, std::memory_order_relaxed);
+}
 
-        GstMapInfo map;
-        if (!gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
-            g_print("Failed to map buffer\n");
-            gst_buffer_unref(buffer);
-            return;
-        }
+static void client_connected(GstRTSPServer *server, GstRTSPClient *client, gpointer user_data) {
+    rtsp_clients.fetch_add(1, std::memory_order_relaxed);
+    g_signal_connect(client, "closed", G_CALLBACK(client_closed), NULL);
+}
 
-        memcpy(map.data, yuv_frame.data, yuv_frame.total());
-        gst_buffer_unmap(buffer, &map);
-        
-        GST_BUFFER_PTS(buffer) = timestamp;
-        GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale_int(1, GST_SECOND, 15);
-        timestamp += GST_BUFFER_DURATION(buffer);
-        
-        GstFlowReturn ret;
-        g_signal_emit_by_name(appsrc, "push-buffer", buffer, &ret);
-        
-        if (ret != GST_FLOW_OK) {
-            g_print("Push buffer returned %d\n", ret);
-        }
-        
-        gst_buffer_unref(buffer);
+static gboolean print_frame_stats(gpointer user_data) {
+    auto *cameras = static_cast<std::vector<std::unique_ptr<Camera>> *>(user_data);
+    for (auto &camera : *cameras) {
+        g_print("[%s] ", camera->name().c_str());
+        camera->frames().print_stats();
+        camera->print_feed_stats();
+        camera->timing_stats().print(camera->name().c_str());
     }
+    return G_SOURCE_CONTINUE;
 }
 
-static void media_configure(GstRTSPMediaFactory *factory, GstRTSPMedia *media, gpointer user_data) {
-    GstElement *element = gst_rtsp_media_get_element(media);
-    appsrc = GST_APP_SRC(gst_bin_get_by_name_recurse_up(GST_BIN(element), "source"));
-    
-    g_object_set(G_OBJECT(appsrc),
-                "format", GST_FORMAT_TIME,
-                "is-live", TRUE,
-                "do-timestamp", FALSE,
-                NULL);
-                
-    gst_app_src_set_stream_type(appsrc, GST_APP_STREAM_TYPE_STREAM);
-    
-    timestamp = 0;
-    
-    GstCaps *caps = gst_caps_new_simple("video/x-raw",
-                                       "format", G_TYPE_STRING, "I420",
-                                       "width", G_TYPE_INT, 800,
-                                       "height", G_TYPE_INT, 600,
-                                       "framerate", GST_TYPE_FRACTION, 15, 1,
-                                       NULL);
-    gst_app_src_set_caps(appsrc, caps);
-    gst_caps_unref(caps);
-    
-    g_signal_connect(appsrc, "need-data", G_CALLBACK(need_data), NULL);
-    
-    gst_object_unref(element);
+static void print_usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [OPTIONS] [--config FILE] [SOURCE...]" << std::endl
+              << "  SOURCE is a device index, a /dev/video node, a video file or 'videotestsrc'." << std::endl
+              << "  Sources given on the command line are mounted as /cam0, /cam1, ..." << std::endl
+              << "  With no sources, /dev/video0 is served as /cam0." << std::endl
+              << "  --size WxH            capture size (default 800x600)" << std::endl
+              << "  --fps N               capture rate (default 15)" << std::endl
+              << "  --capture MODE        opencv (default, decodes to BGR) or native mjpeg, yuyv or nv12" << std::endl
+              << "Streaming options:" << std::endl
+              << "  --bitrate N           kbit/s of the full rendition (default 2000)" << std::endl
+              << "  --ladder LIST         extra renditions, e.g. half,quarter: mounted as /camN/half" << std::endl
+              << "                        and /camN/quarter at 35% and 12% of the bitrate" << std::endl
+              << "  --rtsp-threads N      threads serving RTSP clients, -1 for one per client (default 4)" << std::endl
+              << "  --rtsp-backlog N      pending connections queued during a connection storm (default 128)" << std::endl
+              << "  --max-sessions N      refuse RTSP sessions beyond N (default 0, no limit)" << std::endl
+              << "Multicast (each packet sent once, whatever the number of viewers):" << std::endl
+              << "  --multicast           stream every mount to a multicast group (clients: protocols=udp-mcast)" << std::endl
+              << "  --multicast-range A-B group addresses (default 239.255.42.1-239.255.42.254)" << std::endl
+              << "  --multicast-ports A-B RTP/RTCP ports, starting even (default 5000-5999)" << std::endl
+              << "  --multicast-ttl N     hops the packets may travel (default 1, the local network)" << std::endl
+              << "  --multicast-iface IF  interface to send on (default from the routing table)" << std::endl
+              << "  --unicast-fallback    still serve unicast UDP and TCP to clients that cannot join" << std::endl
+              << "Motion gating:" << std::endl
+              << "  --motion              encode at full rate only while the scene changes" << std::endl
+              << "  --idle-fps N          frames encoded per second while static (default 1)" << std::endl
+              << "  --motion-hold N       keep full rate N seconds after the last motion (default 3)" << std::endl
+              << "  --motion-threshold N  mean luma change of a 16x16 block that counts (default 6)" << std::endl
+              << "Frame tap for local analytics (see frame_tap.py):" << std::endl
+              << "  --tap                 share downscaled BGR frames through memfd" << std::endl
+              << "  --tap-scale F         tap size relative to the capture size (default 0.5)" << std::endl
+              << "  --tap-fps N           most frames per second written to the tap (default 5)" << std::endl
+              << "  --tap-socket PATH     socket handing out the taps (default /tmp/wbcam_tap.sock)" << std::endl
+              << "  --metrics-port N      serve stage timings and counters on 127.0.0.1:N (Prometheus text)" << std::endl
+              << "Recording options:" << std::endl
+              << "  --record MODE         continuous (default), events, both or off" << std::endl
+              << "  --segment-seconds N   rotate segments every N seconds (default 60)" << std::endl
+              << "  --segment-mb N        also rotate once a segment reaches N MiB" << std::endl
+              << "  --no-index            do not write <segment>.idx keyframe indexes" << std::endl
+              << "Event recording (--record events|both):" << std::endl
+              << "  --pre-seconds N       keep the last N seconds in memory (default 10)" << std::endl
+              << "  --post-seconds N      record N seconds after a trigger (default 20)" << std::endl
+              << "  --pre-mb N            cap the in-memory pre-roll at N MiB per camera (default 32)" << std::endl
+              << "  --event-socket PATH   trigger socket (default /tmp/wbcam_events.sock)" << std::endl;
 }
 
-void start_video_saving_thread() {
-    std::thread([&]() {
-        while (is_running) {
-            std::string filename = generate_filename();
-            g_print("Saving video to file: %s\n", filename.c_str());
-
-            cv::VideoWriter writer(filename, cv::VideoWriter::fourcc('a', 'v', 'c', '1'), 15, cv::Size(800, 600));
-            
-            auto start_time = std::chrono::steady_clock::now();
-            while (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start_time).count() < 60) {
-                std::unique_lock<std::mutex> lock(frame_mutex);
-                frame_cv.wait(lock, [] { return new_frame_available; });
-                
-                if (!latest_frame.empty()) {
-                    writer.write(latest_frame);
+int main(int argc, char *argv[]) {
+    gst_init(&argc, &argv);
+
+    std::vector<CameraConfig> configs;
+    RecordSettings record;
+    EventSettings events;
+    MotionSettings motion;
+    TapSettings tap;
+    std::string tap_socket = "/tmp/wbcam_tap.sock";
+    std::string record_mode = "continuous";
+    std::string event_socket = "/tmp/wbcam_events.sock";
+    std::string capture = "opencv";
+    std::vector<RenditionSpec> ladder;
+    parse_ladder("full", ladder);
+    int bitrate = 2000;
+    int metrics_port = 0;
+    RtspPoolSettings pool;
+    MulticastSettings multicast;
+    int width = 800, height = 600, fps = 15;
+    // std::stoi and friends throw on a malformed number.
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--size" && i + 1 < argc) {
+                if (!parse_format(argv[++i], width, height, fps)) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--fps" && i + 1 < argc) {
+                fps = std::stoi(argv[++i]);
+                if (fps <= 0) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--bitrate" && i + 1 < argc) {
+                bitrate = std::stoi(argv[++i]);
+                if (bitrate <= 0) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--ladder" && i + 1 < argc) {
+                if (!parse_ladder(argv[++i], ladder)) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--rtsp-threads" && i + 1 < argc) {
+                pool.threads = std::stoi(argv[++i]);
+                if (pool.threads == 0 || pool.threads < -1) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--rtsp-backlog" && i + 1 < argc) {
+                pool.backlog = std::stoi(argv[++i]);
+            } else if (arg == "--max-sessions" && i + 1 < argc) {
+                pool.max_sessions = std::stoi(argv[++i]);
+            } else if (arg == "--multicast") {
+                multicast.enabled = true;
+            } else if (arg == "--multicast-range" && i + 1 < argc) {
+                if (!parse_range(argv[++i], multicast.min_address, multicast.max_address)) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--multicast-ports" && i + 1 < argc) {
+                if (!parse_port_range(argv[++i], multicast.min_port, multicast.max_port)) {
+                    print_usage(argv[0]);
+                    return -1;
                 }
-                new_frame_available = false;
+            } else if (arg == "--multicast-ttl" && i + 1 < argc) {
+                multicast.ttl = std::stoi(argv[++i]);
+            } else if (arg == "--multicast-iface" && i + 1 < argc) {
+                multicast.iface = argv[++i];
+            } else if (arg == "--unicast-fallback") {
+                multicast.unicast_fallback = true;
+            } else if (arg == "--capture" && i + 1 < argc) {
+                capture = argv[++i];
+                if (capture != "opencv" && !NativeCapture::valid_mode(capture)) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--motion") {
+                motion.enabled = true;
+            } else if (arg == "--idle-fps" && i + 1 < argc) {
+                motion.idle_fps = std::stoi(argv[++i]);
+                if (motion.idle_fps <= 0) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--motion-hold" && i + 1 < argc) {
+                motion.hold = std::stoull(argv[++i]) * GST_SECOND;
+            } else if (arg == "--motion-threshold" && i + 1 < argc) {
+                motion.threshold = std::stoi(argv[++i]);
+            } else if (arg == "--tap") {
+                tap.enabled = true;
+            } else if (arg == "--tap-scale" && i + 1 < argc) {
+                tap.scale = std::stod(argv[++i]);
+                if (tap.scale <= 0 || tap.scale > 1) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--tap-fps" && i + 1 < argc) {
+                tap.fps = std::stoi(argv[++i]);
+                if (tap.fps <= 0) {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+            } else if (arg == "--tap-socket" && i + 1 < argc) {
+                tap_socket = argv[++i];
+            } else if (arg == "--metrics-port" && i + 1 < argc) {
+                metrics_port = std::stoi(argv[++i]);
+            } else if (arg == "--record" && i + 1 < argc) {
+                record_mode = argv[++i];
+            } else if (arg == "--pre-seconds" && i + 1 < argc) {
+                events.pre_roll = std::stoull(argv[++i]) * GST_SECOND;
+            } else if (arg == "--post-seconds" && i + 1 < argc) {
+                events.post_roll = std::stoull(argv[++i]) * GST_SECOND;
+            } else if (arg == "--pre-mb" && i + 1 < argc) {
+                events.max_bytes = std::stoull(argv[++i]) * 1024 * 1024;
+            } else if (arg == "--event-socket" && i + 1 < argc) {
+                event_socket = argv[++i];
+            } else if (arg == "--segment-seconds" && i + 1 < argc) {
+                record.segment_time = std::stoull(argv[++i]) * GST_SECOND;
+            } else if (arg == "--segment-mb" && i + 1 < argc) {
+                record.segment_bytes = std::stoull(argv[++i]) * 1024 * 1024;
+            } else if (arg == "--no-index") {
+                record.write_index = false;
+            } else if (arg == "--config" && i + 1 < argc) {
+                if (!load_camera_config(argv[++i], configs)) {
+                    return -1;
+                }
+            } else if (arg == "-h" || arg == "--help") {
+                print_usage(argv[0]);
+                return 0;
+            } else {
+                CameraConfig config;
+                config.name = "cam" + std::to_string(configs.size());
+                config.source = arg;
+                configs.push_back(config);
             }
-            
-            writer.release();
-            g_print("Video saved: %s\n", filename.c_str());
         }
-    }).detach();
-}
-
-int main(int argc, char *argv[]) {
-    gst_init(&argc, &argv);
-    
-    cv::VideoCapture cap(0);
-    if (!cap.isOpened()) {
-        std::cerr << "Error: Could not open webcam!" << std::endl;
+    } catch (const std::exception &) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (configs.empty()) {
+        CameraConfig config;
+        config.name = "cam0";
+        config.source = "0";
+        configs.push_back(config);
+    }
+    if (record_mode != "continuous" && record_mode != "events" && record_mode != "both" && record_mode != "off") {
+        print_usage(argv[0]);
         return -1;
     }
-    
-    cap.set(cv::CAP_PROP_FRAME_WIDTH, 800);
-    cap.set(cv::CAP_PROP_FRAME_HEIGHT, 600);
-    cap.set(cv::CAP_PROP_FPS, 15);
-    
+    bool continuous = record_mode == "continuous" || record_mode == "both";
+    bool event_clips = record_mode == "events" || record_mode == "both";
+    for (CameraConfig &config : configs) {
+        if (!config.format_set) {
+            config.width = width;
+            config.height = height;
+            config.fps = fps;
+        }
+        config.bitrate = bitrate;
+        config.ladder = ladder;
+        if (!config.capture_set) {
+            config.capture = capture;
+        }
+        config.record = record;
+        config.record.prefix = continuous ? config.name : "";
+        config.events = events;
+        config.events.prefix = event_clips ? config.name : "";
+        config.motion = motion;
+        config.tap = tap;
+    }
+
+    std::vector<std::unique_ptr<Camera>> cameras;
+    for (const CameraConfig &config : configs) {
+        std::unique_ptr<Camera> camera(new Camera(config));
+        if (!camera->open()) {
+            return -1;
+        }
+        cameras.push_back(std::move(camera));
+    }
+
     GstRTSPServer *server = gst_rtsp_server_new();
     g_object_set(server, "service", "8554", NULL);
-    
+    g_signal_connect(server, "client-connected", G_CALLBACK(client_connected), NULL);
+    metrics::Registry::global().expose("wbcam_rtsp_clients", "RTSP clients currently connected.", "gauge", "",
+                                       [] { return (double)rtsp_clients.load(); });
+
+    // One pool serves every mount, so adding a camera adds a capture thread
+    // but no extra main loop or server.
+    configure_rtsp_server(server, pool);
+    MulticastTransport transport;
+    if (!transport.configure(multicast)) {
+        return -1;
+    }
+
     GstRTSPMountPoints *mounts = gst_rtsp_server_get_mount_points(server);
-    
-    std::string launch_str = 
-        "( appsrc name=source is-live=true block=true format=time ! "
-        "videoconvert ! "
-        "x264enc tune=zerolatency speed-preset=ultrafast bitrate=2000 key-int-max=15 ! "
-        "h264parse ! "
-        "rtph264pay config-interval=1 name=pay0 pt=96 )";
-    
-    GstRTSPMediaFactory *factory = gst_rtsp_media_factory_new();
-    gst_rtsp_media_factory_set_launch(factory, launch_str.c_str());
-    gst_rtsp_media_factory_set_shared(factory, TRUE);
-    gst_rtsp_media_factory_set_latency(factory, 0);
-    
-    g_signal_connect(factory, "media-configure", G_CALLBACK(media_configure), NULL);
-    
-    gst_rtsp_mount_points_add_factory(mounts, "/test", factory);
+    for (auto &camera : cameras) {
+        camera->mount(mounts, &transport);
+    }
     g_object_unref(mounts);
-    
+
     gst_rtsp_server_attach(server, NULL);
-    g_print("Stream ready at rtsp://127.0.0.1:8554/test\n");
-    
+    for (auto &camera : cameras) {
+        for (const std::string &path : camera->mount_paths()) {
+            g_print("Stream ready at rtsp://127.0.0.1:8554%s\n", path.c_str());
+        }
+    }
+
     loop = g_main_loop_new(NULL, FALSE);
-    
-    std::thread streaming_thread([&]() {
-        cv::Mat frame;
-        using namespace std::chrono;
-        auto next_frame_time = steady_clock::now();
-        const auto frame_duration = duration_cast<nanoseconds>(duration<double>(1.0/15.0));
-        
-        while (is_running) {
-            cap >> frame;
-            if (frame.empty()) {
-                std::cerr << "Error: Could not capture frame!" << std::endl;
-                break;
+
+    for (auto &camera : cameras) {
+        if (!camera->start()) {
+            return -1;
+        }
+    }
+    g_timeout_add_seconds(30, print_frame_stats, &cameras);
+    add_session_cleanup(server);
+
+    TriggerServer triggers;
+    if (event_clips) {
+        bool started = triggers.start(event_socket, [&cameras](const std::string &name, int post_seconds) {
+            GstClockTime post_roll = post_seconds > 0 ? post_seconds * GST_SECOND : GST_CLOCK_TIME_NONE;
+            std::string reply;
+            for (auto &camera : cameras) {
+                if (name == "*" || name == camera->name()) {
+                    std::string clip = camera->trigger_event(post_roll);
+                    if (!clip.empty()) {
+                        reply += " " + clip;
+                    }
+                }
             }
-            
-            {
-                std::lock_guard<std::mutex> lock(frame_mutex);
-                latest_frame = frame.clone();
-                new_frame_available = true;
-                frame_cv.notify_one();
+            return reply.empty() ? std::string("ERR no clip started") : "OK" + reply;
+        });
+        if (!started) {
+            return -1;
+        }
+    }
+
+    TapServer taps;
+    if (tap.enabled) {
+        bool started = taps.start(tap_socket, [&cameras](const std::string &name) -> FrameTap * {
+            for (auto &camera : cameras) {
+                if (name == camera->name()) {
+                    return camera->frame_tap();
+                }
             }
-            
-            next_frame_time += frame_duration;
-            std::this_thread::sleep_until(next_frame_time);
+            return nullptr;
+        });
+        if (!started) {
+            return -1;
         }
-    });
-    
-    start_video_saving_thread();
-    
+    }
+
+    metrics::MetricsServer metrics_server;
+    if (metrics_port > 0 && !metrics_server.start(metrics_port)) {
+        return -1;
+    }
+
     g_main_loop_run(loop);
-    
-    is_running = false;
-    streaming_thread.join();
-    
-    if (appsrc) {
-        gst_object_unref(appsrc);
+
+    metrics_server.stop();
+    taps.stop();
+    triggers.stop();
+    for (auto &camera : cameras) {
+        camera->stop();
     }
     g_main_loop_unref(loop);
-    
+
     return 0;
 }
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include "chat_proto.h"
+
+// Load generator for the chat server: opens many clients speaking the
+// client.c protocol (see chat_proto.h), lets a few
+// of them send at a fixed total rate and counts what every client receives.
+// Point it at any server build to compare them, e.g.
+//   ./server -f -p 12399 & ./chat_bench -p 12399 -c 10000
+
+#define MAX_EVENTS 1024
+#define CONNECTS_IN_FLIGHT 256
+
+typedef struct {
+    int sock;
+    int connected;
+    int alive;
+    ChatParser parser;
+} BenchClient;
+
+BenchClient *bench_clients;
+int epoll_fd;
+int alive_count = 0;
+long long delivered = 0;
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int start_connect(int id, struct sockaddr_in *addr) {
+    BenchClient *client = &bench_clients[id];
+    chat_parser_init(&client->parser);
+    client->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(client->sock, (struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        close(client->sock);
+        client->sock = -1;
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.u32 = id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->sock, &ev);
+    return 0;
+}
+
+void drop_client(BenchClient *client) {
+    if (client->sock >= 0) {
+        close(client->sock);
+        client->sock = -1;
+    }
+    alive_count -= client->alive;
+    client->alive = 0;
+}
+
+// Handles one epoll event: completes a connect by logging in, or counts
+// the messages received.
+int handle_event(int id, unsigned events) {
+    BenchClient *client = &bench_clients[id];
+    if (client->sock < 0) {
+        return 0;
+    }
+    if (!client->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(client->sock, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error || (events & (EPOLLERR | EPOLLHUP))) {
+            drop_client(client);
+            return 1;
+        }
+        char login[CHAT_HEADER_SIZE + 32];
+        int n = snprintf(login + CHAT_HEADER_SIZE, 32, "bench%d", id);
+        chat_encode_header(login, CHAT_LOGIN, 0, n);
+        if (send(client->sock, login, CHAT_HEADER_SIZE + n, MSG_NOSIGNAL) != CHAT_HEADER_SIZE + n) {
+            drop_client(client);
+            return 1;
+        }
+        client->connected = client->alive = 1;
+        alive_count++;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u32 = id;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->sock, &ev);
+        return 1;
+    }
+
+    for (;;) {
+        size_t space;
+        char *buffer = chat_parser_space(&client->parser, &space);
+        ssize_t n = read(client->sock, buffer, space);
+        if (n > 0) {
+            chat_parser_commit(&client->parser, n);
+            ChatFrame frame;
+            ChatParseResult result;
+            while ((result = chat_parser_next(&client->parser, &frame)) == CHAT_FRAME) {
+                delivered++;
+            }
+            if (result == CHAT_BAD) {
+                fprintf(stderr, "bench%d: bad frame from the server\n", id);
+                drop_client(client);
+                return 0;
+            }
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            drop_client(client);
+        }
+        return 0;
+    }
+}
+
+void poll_events(int timeout_ms, int *finished) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; ++i) {
+        *finished += handle_event(events[i].data.u32, events[i].events);
+    }
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c clients] [-s senders] [-r rate] [-d seconds] [-m bytes]\n", prog);
+    fprintf(stderr, "  -c clients   connections to open (default 1000)\n");
+    fprintf(stderr, "  -s senders   clients that send messages (default 10)\n");
+    fprintf(stderr, "  -r rate      messages per second sent by all senders together (default 100)\n");
+    fprintf(stderr, "  -d seconds   how long to send (default 10)\n");
+    fprintf(stderr, "  -m bytes     text size of each message (default 64, at most %d)\n", CHAT_MAX_TEXT);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = 12345;
+    int count = 1000;
+    int senders = 10;
+    int rate = 100;
+    int seconds = 10;
+    int size = 64;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:s:r:d:m:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': count = atoi(optarg); break;
+        case 's': senders = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'm': size = atoi(optarg); break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (count < 2 || senders < 1 || rate < 1 || seconds < 1 || size < 1 || size > CHAT_MAX_TEXT) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(host);
+    addr.sin_port = htons(port);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    bench_clients = calloc(count, sizeof(BenchClient));
+
+    // Connect phase: a bounded number of connects in flight, so the
+    // server's accept backlog is what is measured, not SYN retries.
+    long long start = now_ms();
+    int started = 0, finished = 0;
+    while (finished < started || started < count) {
+        while (started < count && started - finished < CONNECTS_IN_FLIGHT) {
+            if (start_connect(started++, &addr) < 0) {
+                finished++;
+            }
+        }
+        poll_events(100, &finished);
+        if (now_ms() - start > 30000) {
+            break;
+        }
+    }
+    int connected = 0;
+    for (int i = 0; i < count; ++i) {
+        connected += bench_clients[i].connected;
+    }
+    printf("%d clients: %d connected in %.1f s\n", count, connected, (now_ms() - start) / 1000.0);
+
+    // Send phase: every 10 ms the senders send their share, round robin.
+    char message[CHAT_HEADER_SIZE + CHAT_MAX_TEXT];
+    chat_encode_header(message, CHAT_MESSAGE, 0, size);
+    for (int i = 0; i < size; ++i) {
+        message[CHAT_HEADER_SIZE + i] = 'a' + i % 26;
+    }
+    long long sent = 0, expected = 0;
+    int next_sender = 0;
+    start = now_ms();
+    long long end = start + seconds * 1000LL;
+    while (now_ms() < end) {
+        long long due = (now_ms() - start) * rate / 1000;
+        while (sent < due) {
+            BenchClient *client = &bench_clients[next_sender];
+            next_sender = (next_sender + 1) % (senders < count ? senders : count);
+            sent++;
+            if (client->alive && send(client->sock, message, CHAT_HEADER_SIZE + size, MSG_NOSIGNAL) == CHAT_HEADER_SIZE + size) {
+                expected += alive_count - 1;
+            }
+        }
+        poll_events(10, &finished);
+    }
+    long long send_ms = now_ms() - start;
+
+    // Let the last messages arrive.
+    long long drain_end = now_ms() + 2000;
+    while (now_ms() < drain_end) {
+        poll_events(100, &finished);
+    }
+
+    printf("%d alive after %d s, %lld messages sent (%.0f/s), %lld delivered (%.0f/s, %.1f%% of expected)\n",
+           alive_count, seconds, sent, sent * 1000.0 / send_ms, delivered, delivered * 1000.0 / send_ms,
+           expected ? delivered * 100.0 / expected : 0.0);
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "chat_bus.h"
+
+ChatBus *bus_create(int workers) {
+    if (workers < 1 || workers > BUS_MAX_WORKERS) {
+        return NULL;
+    }
+    ChatBus *bus = mmap(NULL, sizeof(ChatBus), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (bus == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    // The mapping starts zeroed: head 0 and every slot unwritten.
+    bus->worker_count = workers;
+    for (int i = 0; i < workers; ++i) {
+        bus->wake_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (bus->wake_fds[i] < 0) {
+            perror("eventfd");
+            return NULL;
+        }
+    }
+    return bus;
+}
+
+void bus_cursor_init(ChatBus *bus, BusCursor *cursor) {
+    cursor->next = atomic_load(&bus->head);
+    cursor->lost = 0;
+}
+
+// A seqlock per slot: the sequence is cleared while the slot is written and
+// set to position + 1 once it is complete, so a reader can tell a finished
+// message from one in progress or one already overwritten by a later lap.
+void bus_publish(ChatBus *bus, int worker, int sock, const char *data, size_t len) {
+    // `writing` says which slot is ours should we die before finishing it;
+    // UINT64_MAX covers the moment between reserving and knowing which.
+    atomic_store(&bus->writing[worker], UINT64_MAX);
+    uint64_t pos = atomic_fetch_add(&bus->head, 1);
+    atomic_store(&bus->writing[worker], pos + 1);
+    BusSlot *slot = &bus->slots[pos & (BUS_SLOTS - 1)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->origin_worker = worker;
+    slot->origin_sock = sock;
+    slot->len = len > BUS_MESSAGE_MAX ? BUS_MESSAGE_MAX : len;
+    memcpy(slot->data, data, slot->len);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_store_explicit(&bus->writing[worker], 0, memory_order_release);
+}
+
+void bus_mark_dead(ChatBus *bus, int worker) {
+    atomic_store(&bus->dead[worker], 1);
+    bus_notify(bus, worker);
+}
+
+// Whether the slot at `pos` was reserved by a worker that has since died.
+static int writer_died(ChatBus *bus, uint64_t pos) {
+    for (int i = 0; i < bus->worker_count; ++i) {
+        if (atomic_load(&bus->dead[i])) {
+            uint64_t writing = atomic_load(&bus->writing[i]);
+            if (writing == pos + 1 || writing == UINT64_MAX) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void bus_notify(ChatBus *bus, int worker) {
+    uint64_t one = 1;
+    for (int i = 0; i < bus->worker_count; ++i) {
+        if (i != worker && write(bus->wake_fds[i], &one, sizeof(one)) < 0) {
+            // EAGAIN: the counter is full, so that worker is woken anyway.
+        }
+    }
+}
+
+void bus_clear_wakeup(ChatBus *bus, int worker) {
+    uint64_t count;
+    if (read(bus->wake_fds[worker], &count, sizeof(count)) < 0) {
+        // EAGAIN: nothing was signalled.
+    }
+}
+
+int bus_read(ChatBus *bus, BusCursor *cursor, BusMessage *message) {
+    for (;;) {
+        uint64_t pos = cursor->next;
+        if (pos >= atomic_load_explicit(&bus->head, memory_order_acquire)) {
+            return 0;
+        }
+        BusSlot *slot = &bus->slots[pos & (BUS_SLOTS - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos + 1) {
+            message->origin_worker = slot->origin_worker;
+            message->origin_sock = slot->origin_sock;
+            message->len = slot->len;
+            memcpy(message->data, slot->data, message->len > BUS_MESSAGE_MAX ? BUS_MESSAGE_MAX : message->len);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) {
+                cursor->next = pos + 1;
+                return 1;
+            }
+        } else if (seq < pos + 1) {
+            // Reserved but not written yet; its writer wakes us when done,
+            // or the parent does once it has reaped a writer that never will.
+            if (!writer_died(bus, pos)) {
+                return 0;
+            }
+            cursor->lost++;
+            cursor->next = pos + 1;
+            continue;
+        }
+
+        // Overwritten by a later lap: skip to the oldest slot still intact.
+        uint64_t oldest = atomic_load(&bus->head) - BUS_SLOTS + 1;
+        cursor->lost += oldest - pos;
+        cursor->next = oldest;
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef CHAT_BUS_H
+#define CHAT_BUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Shared-memory message bus between the server's worker processes.
+//
+// Every chat message is published once into a ring of fixed-size slots in
+// an anonymous shared mapping, created before the workers are forked. Each
+// worker reads the ring with a cursor of its own and hands every message to
+// its own clients, so a message reaches each client exactly once, whichever
+// worker accepted the sender. Publishing never waits for readers: a worker
+// that falls a whole ring behind loses the overwritten messages (and learns
+// how many) instead of holding anyone up. A slot left half-written by a
+// worker that died inside bus_publish() is skipped once the parent has
+// reaped that worker (bus_mark_dead).
+
+#define BUS_SLOTS 4096                  // power of two
+#define BUS_MESSAGE_MAX 1152            // a whole encoded chat frame
+#define BUS_MAX_WORKERS 64
+
+typedef struct {
+    _Atomic uint64_t seq;               // position + 1 once written, 0 while being written
+    int origin_worker;
+    int origin_sock;                    // the sender, who does not get its own message
+    uint32_t len;
+    char data[BUS_MESSAGE_MAX];
+} BusSlot;
+
+typedef struct {
+    _Atomic uint64_t head;              // next position to publish at
+    int worker_count;
+    int wake_fds[BUS_MAX_WORKERS];      // eventfd per worker, written after publishing
+    _Atomic uint64_t writing[BUS_MAX_WORKERS];  // position + 1 a worker is writing, 0 outside bus_publish
+    _Atomic int dead[BUS_MAX_WORKERS];  // set by the parent once it reaped the worker
+    BusSlot slots[BUS_SLOTS];
+} ChatBus;
+
+typedef struct {
+    uint64_t next;                      // next position to read
+    uint64_t lost;                      // messages overwritten before they were read
+} BusCursor;
+
+typedef struct {
+    int origin_worker;
+    int origin_sock;
+    uint32_t len;
+    char data[BUS_MESSAGE_MAX];
+} BusMessage;
+
+// Maps the bus and creates one eventfd per worker; NULL on failure.
+ChatBus *bus_create(int workers);
+
+// A cursor that starts with the next message published.
+void bus_cursor_init(ChatBus *bus, BusCursor *cursor);
+
+// Copies `len` bytes (at most BUS_MESSAGE_MAX) into the next slot.
+void bus_publish(ChatBus *bus, int worker, int sock, const char *data, size_t len);
+
+// Wakes the other workers; call once after a batch of bus_publish().
+void bus_notify(ChatBus *bus, int worker);
+
+// Marks a reaped worker, so the others skip a slot it left unfinished, and
+// wakes them to do so. Called by the parent.
+void bus_mark_dead(ChatBus *bus, int worker);
+
+// Clears the worker's wake-up eventfd.
+void bus_clear_wakeup(ChatBus *bus, int worker);
+
+// Copies the next message into `message`. Returns 0 when there is none yet,
+// including while a slot is still being written: its writer's bus_notify()
+// brings the reader back. A slot whose writer died is counted as lost.
+int bus_read(ChatBus *bus, BusCursor *cursor, BusMessage *message);
+
+#endif
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "chat_log.h"
+
+#define LOG_BATCH_BYTES (64 * 1024)
+#define LOG_IDLE_NS (10 * 1000 * 1000)  // writer sleep when the queue is empty
+
+// A bounded queue in the style of Dmitry Vyukov's: producers claim a slot by
+// advancing `tail` with a CAS, and each slot's sequence number says whether
+// it is free for this lap, filled, or still in use by the previous lap.
+typedef struct {
+    _Atomic size_t seq;
+    struct timespec time;
+    int len;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+static LogSlot slots[LOG_QUEUE_SLOTS];
+static _Atomic size_t tail;             // next slot to claim
+static size_t head;                     // next slot to write; writer thread only
+static _Atomic unsigned long long dropped;
+
+static char log_path[4096];
+static size_t log_max_bytes;
+static int log_fd = -1;
+static pthread_t writer;
+static atomic_int running;
+
+static int open_log(void) {
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Several workers may pass the limit together: under the lock, only the one
+// that still finds the full file at the path shifts it, and the others just
+// reopen.
+static void rotate(void) {
+    flock(log_fd, LOCK_EX);
+    struct stat by_fd, by_path;
+    if (fstat(log_fd, &by_fd) == 0 && stat(log_path, &by_path) == 0 && by_fd.st_ino == by_path.st_ino &&
+        (size_t)by_path.st_size >= log_max_bytes) {
+        char from[sizeof(log_path) + 16], to[sizeof(log_path) + 16];
+        for (int i = LOG_KEEP - 1; i > 0; --i) {
+            snprintf(from, sizeof(from), "%s.%d", log_path, i);
+            snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", log_path);
+        rename(log_path, to);
+    }
+    flock(log_fd, LOCK_UN);
+    fdatasync(log_fd);
+    close(log_fd);
+    open_log();
+}
+
+// Another worker rotated the file: follow it to the new one.
+static void reopen_if_moved(void) {
+    struct stat by_fd, by_path;
+    if (fstat(log_fd, &by_fd) == 0 && (stat(log_path, &by_path) != 0 || by_fd.st_ino != by_path.st_ino)) {
+        close(log_fd);
+        open_log();
+    }
+}
+
+static void write_batch(const char *batch, size_t len) {
+    if (log_fd < 0 || len == 0) {
+        return;
+    }
+    if (write(log_fd, batch, len) < 0 || !log_max_bytes) {
+        return;
+    }
+    // The file's size, not our own count: every worker appends to it.
+    struct stat st;
+    if (fstat(log_fd, &st) == 0 && (size_t)st.st_size >= log_max_bytes) {
+        rotate();
+    }
+}
+
+// Moves queued lines into `batch` with their timestamps; returns the bytes used.
+static size_t take_lines(char *batch, size_t cap) {
+    size_t used = 0;
+    for (;;) {
+        LogSlot *slot = &slots[head & (LOG_QUEUE_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1) {
+            return used;            // empty, or the producer is still writing it
+        }
+        if (used + LOG_LINE_MAX + 32 > cap) {
+            return used;
+        }
+        struct tm tm;
+        localtime_r(&slot->time.tv_sec, &tm);
+        used += strftime(batch + used, cap - used, "%Y-%m-%d %H:%M:%S", &tm);
+        used += snprintf(batch + used, cap - used, ".%03ld ", slot->time.tv_nsec / 1000000);
+        memcpy(batch + used, slot->text, slot->len);
+        used += slot->len;
+        batch[used++] = '\n';
+        atomic_store_explicit(&slot->seq, head + LOG_QUEUE_SLOTS, memory_order_release);
+        head++;
+    }
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    static char batch[LOG_BATCH_BYTES];
+    struct timespec last_sync, now;
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    unsigned long long reported = 0;
+    int unsynced = 0;
+
+    for (;;) {
+        int stopping = !atomic_load(&running);
+        size_t len = take_lines(batch, sizeof(batch));
+        if (len > 0) {
+            write_batch(batch, len);
+            unsynced = 1;
+            if (len + LOG_LINE_MAX + 32 > sizeof(batch)) {
+                continue;           // more is waiting
+            }
+        }
+
+        unsigned long long lost = atomic_load(&dropped);
+        if (lost != reported) {
+            char note[96];
+            int n = snprintf(note, sizeof(note), "%llu log lines dropped, the log queue was full.\n", lost - reported);
+            write_batch(note, n);
+            reported = lost;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > last_sync.tv_sec || stopping) {
+            if (unsynced) {
+                fdatasync(log_fd);
+                unsynced = 0;
+            }
+            reopen_if_moved();
+            last_sync = now;
+        }
+        if (stopping) {
+            return NULL;
+        }
+        if (len == 0) {
+            struct timespec idle = {0, LOG_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+}
+
+int log_open(const char *path, size_t max_bytes) {
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    log_max_bytes = max_bytes;
+    // After fork() the queue may hold the parent's lines, and no writer.
+    for (size_t i = 0; i < LOG_QUEUE_SLOTS; ++i) {
+        atomic_store(&slots[i].seq, i);
+    }
+    atomic_store(&tail, 0);
+    head = 0;
+    if (open_log() < 0) {
+        perror(path);
+        return -1;
+    }
+    atomic_store(&running, 1);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void log_message(const char *format, ...) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        return;
+    }
+
+    LogSlot *slot;
+    size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    for (;;) {
+        slot = &slots[pos & (LOG_QUEUE_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (seq < pos) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;                 // full: the writer has not freed this slot yet
+        } else {
+            pos = atomic_load_explicit(&tail, memory_order_relaxed);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(slot->text, LOG_LINE_MAX, format, args);
+    va_end(args);
+    slot->len = len < 0 ? 0 : len >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+void log_close(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+    atomic_store(&running, 0);
+    pthread_join(writer, NULL);
+    close(log_fd);
+    log_fd = -1;
+}
@@ -0,0 +1,29 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <stddef.h>
+
+// Asynchronous log for the chat server. log_message() formats the line
+// into a slot of a lock-free multi-producer queue, stamped with the time of
+// the call, and returns: no lock, no syscall. A writer thread takes the
+// lines in batches, formats the timestamps and appends each batch with one
+// write() to a file opened once with O_APPEND, so workers sharing the file
+// never interleave within a line. It calls fdatasync() every second and
+// rotates the file to <path>.1 .. <path>.<LOG_KEEP> once it passes the size
+// limit. When the queue is full, lines are dropped and counted rather than
+// stalling the caller.
+
+#define LOG_LINE_MAX 1200
+#define LOG_QUEUE_SLOTS 2048            // power of two
+#define LOG_KEEP 3                      // rotated files kept
+
+// Starts the writer thread; call in every process that logs, after fork().
+// Returns -1 if the file cannot be opened.
+int log_open(const char *path, size_t max_bytes);
+
+void log_message(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Writes what is queued, syncs and stops the writer thread.
+void log_close(void);
+
+#endif
@@ -0,0 +1,113 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "chat_proto.h"
+
+static uint32_t read_be32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+static void write_be32(char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+void chat_parser_init(ChatParser *parser) {
+    parser->start = parser->end = 0;
+}
+
+char *chat_parser_space(ChatParser *parser, size_t *space) {
+    // The buffer holds two whole frames, so once the parsed bytes are moved
+    // out of the way there is always room for the rest of a partial frame.
+    if (parser->start > 0 && parser->end > sizeof(parser->buf) - CHAT_MAX_FRAME) {
+        memmove(parser->buf, parser->buf + parser->start, parser->end - parser->start);
+        parser->end -= parser->start;
+        parser->start = 0;
+    }
+    *space = sizeof(parser->buf) - parser->end;
+    return parser->buf + parser->end;
+}
+
+void chat_parser_commit(ChatParser *parser, size_t len) {
+    parser->end += len;
+}
+
+size_t chat_parser_feed(ChatParser *parser, const char *data, size_t len) {
+    size_t space;
+    char *to = chat_parser_space(parser, &space);
+    if (len > space) {
+        len = space;
+    }
+    memcpy(to, data, len);
+    chat_parser_commit(parser, len);
+    return len;
+}
+
+ChatParseResult chat_parser_next(ChatParser *parser, ChatFrame *frame) {
+    size_t available = parser->end - parser->start;
+    if (available < CHAT_HEADER_SIZE) {
+        return CHAT_NEED_MORE;
+    }
+
+    const char *header = parser->buf + parser->start;
+    uint8_t version = header[0];
+    uint8_t type = header[1];
+    uint32_t length = read_be32(header + 8);
+    if (version != CHAT_VERSION || header[2] || header[3] ||
+        type < CHAT_LOGIN || type > CHAT_LOGOUT || length > CHAT_MAX_PAYLOAD) {
+        return CHAT_BAD;
+    }
+    if (available < CHAT_HEADER_SIZE + length) {
+        return CHAT_NEED_MORE;
+    }
+
+    frame->type = type;
+    frame->sender = read_be32(header + 4);
+    frame->length = length;
+    frame->payload = header + CHAT_HEADER_SIZE;
+    parser->start += CHAT_HEADER_SIZE + length;
+    if (parser->start == parser->end) {
+        parser->start = parser->end = 0;
+    }
+    return CHAT_FRAME;
+}
+
+void chat_encode_header(char *out, ChatType type, uint32_t sender, uint32_t length) {
+    out[0] = CHAT_VERSION;
+    out[1] = type;
+    out[2] = out[3] = 0;
+    write_be32(out + 4, sender);
+    write_be32(out + 8, length);
+}
+
+int chat_send_frame(int sock, ChatType type, uint32_t sender, const char *payload, size_t length) {
+    char header[CHAT_HEADER_SIZE];
+    chat_encode_header(header, type, sender, length);
+    struct iovec iov[2] = {
+        {header, CHAT_HEADER_SIZE},
+        {(void *)payload, length},
+    };
+    size_t total = CHAT_HEADER_SIZE + length;
+    size_t sent = 0;
+    while (sent < total) {
+        ssize_t n = writev(sock, iov, 2);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+        // Skip what was written, across the two pieces.
+        for (int i = 0; i < 2; ++i) {
+            size_t done = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + done;
+            iov[i].iov_len -= done;
+            n -= done;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef CHAT_PROTO_H
+#define CHAT_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Wire format shared by server.c and client.c. Every message is a frame:
+//
+//   offset  size  field
+//   0       1     version (CHAT_VERSION)
+//   1       1     type (ChatType)
+//   2       2     reserved, 0
+//   4       4     sender id, big-endian: 0 from clients, set by the server
+//   8       4     payload length, big-endian, at most CHAT_MAX_PAYLOAD
+//   12      ...   payload
+//
+// A client sends CHAT_LOGIN with its nickname, then CHAT_MESSAGE frames
+// with the text, and CHAT_LOGOUT to leave. The server relays each message
+// to the other clients as a CHAT_MESSAGE carrying the sender's id and
+// "nickname: text". Payloads are not NUL-terminated.
+
+#define CHAT_VERSION 1
+#define CHAT_HEADER_SIZE 12
+#define CHAT_MAX_NICKNAME 64
+#define CHAT_MAX_TEXT 1024
+#define CHAT_MAX_PAYLOAD (CHAT_MAX_NICKNAME + 2 + CHAT_MAX_TEXT)
+#define CHAT_MAX_FRAME (CHAT_HEADER_SIZE + CHAT_MAX_PAYLOAD)
+
+typedef enum {
+    CHAT_LOGIN = 1,
+    CHAT_MESSAGE = 2,
+    CHAT_LOGOUT = 3,
+} ChatType;
+
+typedef struct {
+    uint8_t type;
+    uint32_t sender;
+    uint32_t length;
+    const char *payload;        // inside the parser, valid until its next call
+} ChatFrame;
+
+// Incremental parser: bytes go straight from read() into its buffer, and
+// every complete frame in it comes out of chat_parser_next(), however TCP
+// split or merged them.
+typedef struct {
+    char buf[2 * CHAT_MAX_FRAME];
+    size_t start;               // first byte not yet parsed
+    size_t end;                 // one past the last byte received
+} ChatParser;
+
+typedef enum {
+    CHAT_NEED_MORE = 0,
+    CHAT_FRAME = 1,
+    CHAT_BAD = -1,              // not a frame of this protocol; drop the connection
+} ChatParseResult;
+
+void chat_parser_init(ChatParser *parser);
+
+// Where to read() into, and how much fits there.
+char *chat_parser_space(ChatParser *parser, size_t *space);
+
+// Accounts for `len` bytes read into chat_parser_space().
+void chat_parser_commit(ChatParser *parser, size_t len);
+
+// Copies `len` bytes in; returns how many fit. For callers that already
+// have the data in a buffer of their own.
+size_t chat_parser_feed(ChatParser *parser, const char *data, size_t len);
+
+ChatParseResult chat_parser_next(ChatParser *parser, ChatFrame *frame);
+
+// Writes a header to `out` (CHAT_HEADER_SIZE bytes).
+void chat_encode_header(char *out, ChatType type, uint32_t sender, uint32_t length);
+
+// Sends one whole frame on a blocking socket with a single writev().
+// Returns 0, or -1 with errno set.
+int chat_send_frame(int sock, ChatType type, uint32_t sender, const char *payload, size_t length);
+
+#endif
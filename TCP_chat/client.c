@@ -3,15 +3,17 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <string.h>
 #include <signal.h>
+#include "chat_proto.h"
 
 #define PORT 12345
 #define BUF_SIZE 1024
 
 typedef struct {
     int sock;
-    char username[50];
+    char username[CHAT_MAX_NICKNAME + 1];
     struct sockaddr_in server_addr;
 } Client;
 
@@ -61,21 +63,33 @@ int main() {
     printf("Enter username: ");
     fgets(client.username, sizeof(client.username), stdin);
     client.username[strcspn(client.username, "\n")] = '\0';
-    write(client.sock, client.username, strlen(client.username) + 1);
+    chat_send_frame(client.sock, CHAT_LOGIN, 0, client.username, strlen(client.username));
 
     // 포크하여 읽기 쓰기 처리
     if ((pid = fork()) == 0) {  // 자식 프로세스: 메시지 수신
-        char recv_buffer[BUF_SIZE];
+        static ChatParser parser;
+        chat_parser_init(&parser);
         while (1) {
-            memset(recv_buffer, 0, BUF_SIZE);
-            int n = read(client.sock, recv_buffer, BUF_SIZE);
+            size_t space;
+            char *recv_buffer = chat_parser_space(&parser, &space);
+            int n = read(client.sock, recv_buffer, space);
             if (n <= 0) {
                 printf("\nDisconnected from server.\n");
                 exit(0);
             }
-            // 서버로부터 받은 메시지를 "유저(이름): 메시지" 형식으로 출력
-            printf("\r%s\n%s: ", recv_buffer, client.username);
+            chat_parser_commit(&parser, n);
+
+            ChatFrame frame;
+            ChatParseResult result;
+            while ((result = chat_parser_next(&parser, &frame)) == CHAT_FRAME) {
+                // 서버로부터 받은 메시지를 "유저(이름): 메시지" 형식으로 출력
+                printf("\r%.*s\n%s: ", (int)frame.length, frame.payload, client.username);
+            }
             fflush(stdout);
+            if (result == CHAT_BAD) {
+                printf("\nUnexpected data from server.\n");
+                exit(0);
+            }
         }
     } else if (pid > 0) {  // 부모 프로세스: 메시지 전송
         while (1) {
@@ -85,13 +99,13 @@ int main() {
 
             if (strcmp(buffer, "logout") == 0) {  // logout 입력 시 종료
                 printf("Logging out...\n");
-                write(client.sock, buffer, strlen(buffer) + 1);
+                chat_send_frame(client.sock, CHAT_LOGOUT, 0, NULL, 0);
                 close(client.sock);  // 소켓 닫기
                 kill(pid, SIGTERM);  // 자식 프로세스 종료
                 break;
             }
 
-            write(client.sock, buffer, strlen(buffer) + 1);
+            chat_send_frame(client.sock, CHAT_MESSAGE, 0, buffer, strlen(buffer));
         }
     } else {
         perror("fork");
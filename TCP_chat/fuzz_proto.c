@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat_proto.h"
+
+// Randomised tests for the chat_proto.h frame parser, built with the
+// address and undefined-behaviour sanitizers by `make fuzz`:
+//   - streams of valid frames, read in at random chunk sizes through
+//     chat_parser_space()/commit(), must come out frame for frame as sent;
+//   - random bytes must never move the parser outside its buffer, and a
+//     header with a bad version, type or length must give CHAT_BAD.
+// Usage: ./fuzz_proto [rounds] [seed]
+
+#define STREAM_FRAMES 64
+
+static unsigned long long rng_state;
+
+static unsigned rng(void) {
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return rng_state >> 33;
+}
+
+static void fail(const char *what, unsigned long long seed, int round) {
+    fprintf(stderr, "FAIL: %s (seed %llu, round %d)\n", what, seed, round);
+    exit(1);
+}
+
+static void check_bounds(const ChatParser *parser, unsigned long long seed, int round) {
+    if (parser->start > parser->end || parser->end > sizeof(parser->buf)) {
+        fail("parser indexes outside its buffer", seed, round);
+    }
+}
+
+// Random length, weighted towards the edges: empty, tiny and maximal.
+static uint32_t random_length(void) {
+    switch (rng() % 4) {
+    case 0:
+        return rng() % 4;
+    case 1:
+        return CHAT_MAX_PAYLOAD - rng() % 4;
+    default:
+        return rng() % (CHAT_MAX_PAYLOAD + 1);
+    }
+}
+
+static void valid_stream(unsigned long long seed, int round) {
+    static char stream[STREAM_FRAMES * CHAT_MAX_FRAME];
+    size_t offsets[STREAM_FRAMES];
+    size_t len = 0;
+    for (int i = 0; i < STREAM_FRAMES; ++i) {
+        offsets[i] = len;
+        uint32_t length = random_length();
+        chat_encode_header(stream + len, CHAT_LOGIN + rng() % 3, rng(), length);
+        for (uint32_t j = 0; j < length; ++j) {
+            stream[len + CHAT_HEADER_SIZE + j] = rng();
+        }
+        len += CHAT_HEADER_SIZE + length;
+    }
+
+    ChatParser parser;
+    chat_parser_init(&parser);
+    size_t fed = 0;
+    int next = 0;
+    while (next < STREAM_FRAMES) {
+        size_t space;
+        char *to = chat_parser_space(&parser, &space);
+        if (to < parser.buf || to + space > parser.buf + sizeof(parser.buf)) {
+            fail("space outside the buffer", seed, round);
+        }
+        if (space == 0) {
+            fail("no space left for a partial frame", seed, round);
+        }
+        // Chunks from one byte up to a whole buffer, as TCP may deliver them.
+        size_t chunk = rng() % 3 == 0 ? 1 + rng() % 16 : 1 + rng() % space;
+        if (chunk > space) {
+            chunk = space;
+        }
+        if (chunk > len - fed) {
+            chunk = len - fed;
+        }
+        memcpy(to, stream + fed, chunk);
+        chat_parser_commit(&parser, chunk);
+        fed += chunk;
+        check_bounds(&parser, seed, round);
+
+        ChatFrame frame;
+        ChatParseResult result;
+        while ((result = chat_parser_next(&parser, &frame)) == CHAT_FRAME) {
+            if (next >= STREAM_FRAMES) {
+                fail("more frames than were sent", seed, round);
+            }
+            const char *sent = stream + offsets[next];
+            if (frame.type != (uint8_t)sent[1] ||
+                frame.sender != ((uint32_t)(uint8_t)sent[4] << 24 | (uint32_t)(uint8_t)sent[5] << 16 |
+                                 (uint32_t)(uint8_t)sent[6] << 8 | (uint8_t)sent[7]) ||
+                offsets[next] + CHAT_HEADER_SIZE + frame.length !=
+                    (next + 1 < STREAM_FRAMES ? offsets[next + 1] : len) ||
+                memcmp(frame.payload, sent + CHAT_HEADER_SIZE, frame.length) != 0) {
+                fail("frame differs from the one sent", seed, round);
+            }
+            ++next;
+        }
+        if (result == CHAT_BAD) {
+            fail("valid stream rejected", seed, round);
+        }
+        check_bounds(&parser, seed, round);
+        if (fed == len && next < STREAM_FRAMES) {
+            fail("stream ended with frames still inside the parser", seed, round);
+        }
+    }
+}
+
+static int header_is_bad(const char *header) {
+    uint32_t length = (uint32_t)(uint8_t)header[8] << 24 | (uint32_t)(uint8_t)header[9] << 16 |
+                      (uint32_t)(uint8_t)header[10] << 8 | (uint8_t)header[11];
+    return header[0] != CHAT_VERSION || header[1] < CHAT_LOGIN || header[1] > CHAT_LOGOUT ||
+           header[2] || header[3] || length > CHAT_MAX_PAYLOAD;
+}
+
+static void random_bytes(unsigned long long seed, int round) {
+    ChatParser parser;
+    chat_parser_init(&parser);
+    for (int step = 0; step < 256; ++step) {
+        char chunk[CHAT_MAX_FRAME];
+        size_t len = 1 + rng() % sizeof(chunk);
+        for (size_t i = 0; i < len; ++i) {
+            chunk[i] = rng();
+        }
+        // Mostly plausible headers, so the length check itself gets hit.
+        if (len >= CHAT_HEADER_SIZE && rng() % 2) {
+            uint32_t length = rng() % 2 ? CHAT_MAX_PAYLOAD + 1 + rng() % 1000 : rng();
+            chat_encode_header(chunk, CHAT_LOGIN + rng() % 3, rng(), length);
+        }
+        chat_parser_feed(&parser, chunk, len);
+        check_bounds(&parser, seed, round);
+
+        ChatFrame frame;
+        for (;;) {
+            const char *header = parser.buf + parser.start;
+            size_t available = parser.end - parser.start;
+            ChatParseResult result = chat_parser_next(&parser, &frame);
+            check_bounds(&parser, seed, round);
+            if (result == CHAT_NEED_MORE) {
+                if (available >= CHAT_HEADER_SIZE && header_is_bad(header)) {
+                    fail("bad header waiting for more data", seed, round);
+                }
+                break;
+            }
+            if (result == CHAT_BAD) {
+                if (!header_is_bad(header)) {
+                    fail("good header rejected", seed, round);
+                }
+                chat_parser_init(&parser);  // the server drops the connection
+                break;
+            }
+            if (header_is_bad(header) || frame.length > CHAT_MAX_PAYLOAD ||
+                frame.payload < parser.buf || frame.payload + frame.length > parser.buf + sizeof(parser.buf)) {
+                fail("frame from a bad header or outside the buffer", seed, round);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    unsigned long long seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    for (int round = 0; round < rounds; ++round) {
+        rng_state = seed * 1000003ULL + round;
+        valid_stream(seed, round);
+        random_bytes(seed, round);
+    }
+    printf("fuzz_proto: %d rounds passed (seed %llu)\n", rounds, seed);
+    return 0;
+}
@@ -1,81 +1,450 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <signal.h>
 #include <fcntl.h>
-#include <stdarg.h>
+#include "chat_bus.h"
+#include "chat_log.h"
+#include "chat_proto.h"
 
 #define PORT 12345
-#define BUF_SIZE 1024
-#define MAX_CLIENTS 1000
+#define LOG_PATH "/var/log/chat_server.log"
+#define MAX_EVENTS 256
 
+_Static_assert(BUS_MESSAGE_MAX >= CHAT_MAX_FRAME, "a relayed frame must fit in a bus slot");
+
+// One encoded frame, allocated once per message and shared by every
+// recipient's queue; freed by whoever drops the last reference.
+typedef struct {
+    int refs;
+    size_t len;
+    char data[];
+} SharedFrame;
+
+// Frames waiting for one client's socket, oldest first.
 typedef struct {
-    int client_sock;
-    int pipe_read[2];
-    int pipe_write[2];
-    char nickname[BUF_SIZE];
-} ClientInfo;
+    SharedFrame **frames;           // ring, cap is a power of two
+    size_t head;
+    size_t count;
+    size_t cap;
+    size_t sent;                    // bytes of the oldest frame already written
+    size_t bytes;                   // unsent bytes in the whole queue
+} OutputQueue;
+
+// One client connection. Every socket is non-blocking and registered
+// edge-triggered, so reads and writes always run until EAGAIN.
+typedef struct Connection {
+    int sock;
+    uint32_t id;                    // sender id in relayed frames
+    int logged_in;                  // after CHAT_LOGIN
+    int index;                      // in clients[], once logged in
+    char nickname[CHAT_MAX_NICKNAME + 1];
+    ChatParser parser;
+    OutputQueue out;
+    unsigned long long dropped;     // frames dropped at the high-water mark
+    int flush_queued;
+    struct Connection *next_flush;
+} Connection;
 
 int server_sock;
-ClientInfo clients[MAX_CLIENTS];
+int epoll_fd;
+ChatBus *bus;
+BusCursor bus_cursor;
+int worker_id = -1;                 // -1 in the parent of several workers
+int worker_count = 1;
+pid_t worker_pids[BUS_MAX_WORKERS];
+int published;                      // messages put on the bus in this loop pass
+uint32_t next_id;
+size_t high_water = 256 * 1024;     // unsent bytes one client may have queued
+int drop_when_full = 0;             // drop its new messages instead of disconnecting it
+const char *log_path = LOG_PATH;
+size_t log_max_bytes = 64 << 20;
+char bus_wakeup;                    // its address marks the bus eventfd in epoll
+volatile sig_atomic_t stop_signal;  // set by SIGINT or SIGTERM
+Connection **clients;               // logged-in connections, in no particular order
 int client_count = 0;
+int client_cap = 0;
+Connection *flush_list;             // connections with new output since the last flush
+
+void frame_unref(SharedFrame *frame) {
+    if (--frame->refs == 0) {
+        free(frame);
+    }
+}
 
-void log_message(const char *format, ...) {
-    va_list args;
-    va_start(args, format);
+void free_connection(Connection *conn) {
+    OutputQueue *out = &conn->out;
+    for (size_t i = 0; i < out->count; ++i) {
+        frame_unref(out->frames[(out->head + i) & (out->cap - 1)]);
+    }
+    free(out->frames);
+    free(conn);
+}
 
-    FILE *log_file = fopen("/var/log/chat_server.log", "a");
-    if (log_file) {
-        vfprintf(log_file, format, args);
-        fprintf(log_file, "\n");
-        fclose(log_file);
+void close_connection(Connection *conn) {
+    if (conn->logged_in) {
+        // 클라이언트가 나갈 때 로그 기록
+        log_message("%s has logout the chat.", conn->nickname);
+        clients[conn->index] = clients[--client_count];
+        clients[conn->index]->index = conn->index;
+    }
+    // Closing the socket also removes it from the epoll set.
+    close(conn->sock);
+    conn->sock = -1;
+    // Still on the flush list: flush_pending() frees it.
+    if (!conn->flush_queued) {
+        free_connection(conn);
+    }
+}
+
+// Writes as much queued output as the socket takes, up to IOV_MAX frames
+// per sendmsg(). Returns -1 once the connection is gone.
+int flush_output(Connection *conn) {
+    OutputQueue *out = &conn->out;
+    while (out->count > 0) {
+        struct iovec iov[IOV_MAX];
+        int iov_count = 0;
+        for (size_t i = 0; i < out->count && iov_count < IOV_MAX; ++i) {
+            SharedFrame *frame = out->frames[(out->head + i) & (out->cap - 1)];
+            size_t skip = i == 0 ? out->sent : 0;
+            iov[iov_count].iov_base = frame->data + skip;
+            iov[iov_count].iov_len = frame->len - skip;
+            iov_count++;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+
+        ssize_t n = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;           // EPOLLOUT fires once the socket drains
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        out->bytes -= n;
+        while (n > 0) {
+            SharedFrame *frame = out->frames[out->head];
+            size_t left = frame->len - out->sent;
+            if ((size_t)n < left) {
+                out->sent += n;
+                break;
+            }
+            n -= left;
+            out->sent = 0;
+            out->head = (out->head + 1) & (out->cap - 1);
+            out->count--;
+            frame_unref(frame);
+        }
     }
+    return 0;
+}
 
-    va_end(args);
+// Queuing costs one pointer per recipient; the high-water mark is checked
+// after the next flush, against what the client did not take.
+void queue_output(Connection *conn, SharedFrame *frame) {
+    OutputQueue *out = &conn->out;
+    if (out->count == out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 16;
+        SharedFrame **frames = malloc(cap * sizeof(SharedFrame *));
+        for (size_t i = 0; i < out->count; ++i) {
+            frames[i] = out->frames[(out->head + i) & (out->cap - 1)];
+        }
+        free(out->frames);
+        out->frames = frames;
+        out->head = 0;
+        out->cap = cap;
+    }
+    out->frames[(out->head + out->count) & (out->cap - 1)] = frame;
+    out->count++;
+    out->bytes += frame->len;
+    frame->refs++;
+
+    if (!conn->flush_queued) {
+        conn->flush_queued = 1;
+        conn->next_flush = flush_list;
+        flush_list = conn;
+    }
 }
 
-void broadcast_message(const char *message, int exclude_sock) {
+// Queues one encoded frame for every client of this worker. The frame is
+// copied once into a shared buffer, not once per recipient, and output is
+// only written once per event loop pass, so a burst of messages costs one
+// sendmsg() per recipient instead of one each.
+void broadcast_message(const char *data, size_t len, int exclude_sock) {
+    SharedFrame *frame = malloc(sizeof(SharedFrame) + len);
+    frame->refs = 1;                // held until every queue has its reference
+    frame->len = len;
+    memcpy(frame->data, data, len);
     for (int i = 0; i < client_count; ++i) {
-        if (clients[i].client_sock != exclude_sock) {
-            write(clients[i].client_sock, message, strlen(message) + 1);
+        if (clients[i]->sock != exclude_sock) {
+            queue_output(clients[i], frame);
         }
     }
+    frame_unref(frame);
 }
 
-void handle_client(ClientInfo *client_info) {
-    char buffer[BUF_SIZE];
+void flush_pending(void) {
+    while (flush_list) {
+        Connection *conn = flush_list;
+        flush_list = conn->next_flush;
+        conn->flush_queued = 0;
+        if (conn->sock < 0) {
+            free_connection(conn);
+            continue;
+        }
+        if (flush_output(conn) < 0) {
+            close_connection(conn);
+        } else if (conn->out.bytes > high_water) {
+            if (!drop_when_full) {
+                log_message("%s is not reading, disconnecting.", conn->nickname);
+                close_connection(conn);
+                continue;
+            }
+            if (conn->dropped == 0) {
+                log_message("%s is not reading, dropping its messages.", conn->nickname);
+            }
+            // Newest first, and never the frame already partly written.
+            OutputQueue *out = &conn->out;
+            while (out->bytes > high_water && out->count > 1) {
+                SharedFrame *frame = out->frames[(out->head + out->count - 1) & (out->cap - 1)];
+                out->count--;
+                out->bytes -= frame->len;
+                frame_unref(frame);
+                conn->dropped++;
+            }
+        }
+    }
+}
 
-    // 클라이언트 접속 로그
-    log_message("%s has login the chat.", client_info->nickname);
+// Hands every message published since the last pass, by any worker, to
+// this worker's clients. The sender is skipped by the worker it is on.
+void deliver_bus_messages(void) {
+    static BusMessage message;
+    uint64_t lost = bus_cursor.lost;
+    while (bus_read(bus, &bus_cursor, &message)) {
+        broadcast_message(message.data, message.len,
+                          message.origin_worker == worker_id ? message.origin_sock : -1);
+    }
+    if (bus_cursor.lost != lost) {
+        log_message("Worker %d fell behind, %llu messages lost.", worker_id,
+                    (unsigned long long)(bus_cursor.lost - lost));
+    }
+}
 
-    close(client_info->pipe_write[1]); // Close unused pipe write end
-    close(client_info->pipe_read[0]);  // Close unused pipe read end
+// Returns -1 once the client logged out or broke the protocol.
+int handle_frame(Connection *conn, const ChatFrame *frame) {
+    if (!conn->logged_in) {
+        if (frame->type != CHAT_LOGIN) {
+            return -1;
+        }
+        int len = frame->length > CHAT_MAX_NICKNAME ? CHAT_MAX_NICKNAME : (int)frame->length;
+        memcpy(conn->nickname, frame->payload, len);
+        conn->nickname[len] = '\0';
+        if (client_count == client_cap) {
+            client_cap = client_cap ? client_cap * 2 : 64;
+            clients = realloc(clients, client_cap * sizeof(Connection *));
+        }
+        conn->index = client_count;
+        clients[client_count++] = conn;
+        conn->logged_in = 1;
+        // 클라이언트 접속 로그
+        log_message("%s has login the chat.", conn->nickname);
+        return 0;
+    }
+    if (frame->type != CHAT_MESSAGE) {
+        return -1;                  // CHAT_LOGOUT, or a second CHAT_LOGIN
+    }
+
+    int text_len = frame->length > CHAT_MAX_TEXT ? CHAT_MAX_TEXT : (int)frame->length;
+    // 채팅 메시지를 "닉네임: 메시지" 형식으로 로그에 기록
+    log_message("%s: %.*s", conn->nickname, text_len, frame->payload);
+
+    // Encoded once here; every worker copies the finished frame to its clients.
+    char relay[CHAT_MAX_FRAME];
+    char *payload = relay + CHAT_HEADER_SIZE;
+    size_t nick_len = strlen(conn->nickname);
+    memcpy(payload, conn->nickname, nick_len);
+    memcpy(payload + nick_len, ": ", 2);
+    memcpy(payload + nick_len + 2, frame->payload, text_len);
+    size_t length = nick_len + 2 + text_len;
+    chat_encode_header(relay, CHAT_MESSAGE, conn->id, length);
+    bus_publish(bus, worker_id, conn->sock, relay, CHAT_HEADER_SIZE + length);
+    published = 1;
+    return 0;
+}
 
-    while (1) {
-        memset(buffer, 0, BUF_SIZE);
-        int n = read(client_info->client_sock, buffer, BUF_SIZE);
-        if (n <= 0 || strcmp(buffer, "logout") == 0) {
-            break;
+// Reads until EAGAIN straight into the connection's parser and handles
+// every complete frame, however TCP split or merged them. Returns -1 once
+// the connection should be closed.
+int handle_input(Connection *conn) {
+    for (;;) {
+        size_t space;
+        char *buffer = chat_parser_space(&conn->parser, &space);
+        ssize_t n = read(conn->sock, buffer, space);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
+        chat_parser_commit(&conn->parser, n);
 
-        // 채팅 메시지를 "닉네임: 메시지" 형식으로 로그에 기록
-        log_message("%s: %s", client_info->nickname, buffer);
+        ChatFrame frame;
+        ChatParseResult result;
+        while ((result = chat_parser_next(&conn->parser, &frame)) == CHAT_FRAME) {
+            if (handle_frame(conn, &frame) < 0) {
+                return -1;
+            }
+        }
+        if (result == CHAT_BAD) {
+            log_message("Dropping a client that does not speak the chat protocol.");
+            return -1;
+        }
+    }
+}
+
+void accept_clients(void) {
+    for (;;) {
+        int client_sock = accept4(server_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                log_message("Maximum number of clients reached.");
+            }
+            return;
+        }
 
-        // 파이프와 브로드캐스트 처리
-        write(client_info->pipe_write[1], buffer, strlen(buffer) + 1);
-        read(client_info->pipe_read[0], buffer, BUF_SIZE);
-        broadcast_message(buffer, client_info->client_sock);
+        Connection *conn = calloc(1, sizeof(Connection));
+        conn->sock = client_sock;
+        conn->id = (uint32_t)worker_id << 24 | (++next_id & 0xffffff);
+        chat_parser_init(&conn->parser);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            close(client_sock);
+            free(conn);
+            continue;
+        }
     }
+}
 
-    // 클라이언트가 나갈 때 로그 기록
-    log_message("%s has logout the chat.", client_info->nickname);
+void run_event_loop(void) {
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_signal) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return;
+        }
 
-    close(client_info->client_sock);
-    exit(0);
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == NULL) {
+                accept_clients();
+                continue;
+            }
+            if (events[i].data.ptr == &bus_wakeup) {
+                bus_clear_wakeup(bus, worker_id);
+                continue;
+            }
+            Connection *conn = events[i].data.ptr;
+            if (conn->sock < 0) {
+                continue;           // closed earlier in this batch
+            }
+            if ((events[i].events & EPOLLOUT) && flush_output(conn) < 0) {
+                close_connection(conn);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && handle_input(conn) < 0) {
+                close_connection(conn);
+            }
+        }
+        if (published) {
+            bus_notify(bus, worker_id);
+            published = 0;
+        }
+        deliver_bus_messages();
+        flush_pending();
+    }
+}
+
+// One worker: its own listening socket on the shared port (the kernel
+// spreads new connections over the workers), its own epoll set and its
+// own cursor on the bus.
+void run_worker(int port) {
+    struct sockaddr_in server_addr;
+
+    bus_cursor_init(bus, &bus_cursor);
+
+    server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind");
+        close(server_sock);
+        exit(1);
+    }
+
+    // Thousands of clients may connect at once.
+    if (listen(server_sock, SOMAXCONN) < 0) {
+        perror("listen");
+        close(server_sock);
+        exit(1);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;             // NULL marks the listening socket
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &ev);
+    ev.events = EPOLLIN;            // level-triggered: cleared by reading it
+    ev.data.ptr = &bus_wakeup;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bus->wake_fds[worker_id], &ev);
+
+    run_event_loop();
+
+    close(server_sock);
 }
 
 void daemonize() {
@@ -97,21 +466,73 @@ void daemonize() {
     dup(0);
 }
 
+// Only flags the loops to stop, so the log can still be flushed on the way
+// out. The parent passes the signal on to its workers.
 void sigint_handler(int signum) {
-    log_message("Received SIGINT, shutting down...");
-    close(server_sock);
-    exit(0);
+    stop_signal = signum;
+    if (worker_id < 0) {
+        for (int i = 0; i < worker_count; ++i) {
+            kill(worker_pids[i], SIGTERM);
+        }
+    }
 }
 
-void sigterm_handler(int signum) {
-    log_message("Received SIGTERM, shutting down...");
-    close(server_sock);
-    exit(0);
+void log_shutdown(void) {
+    log_message("Received %s, shutting down...", stop_signal == SIGINT ? "SIGINT" : "SIGTERM");
+}
+
+// Every client is a socket, so allow as many as the hard limit lets us.
+void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p port] [-f] [-w workers] [-q bytes] [-d] [-l path] [-L MiB]\n", prog);
+    fprintf(stderr, "  -p port      port to listen on (default %d)\n", PORT);
+    fprintf(stderr, "  -f           stay in the foreground instead of daemonizing\n");
+    fprintf(stderr, "  -w workers   worker processes sharing the port, 0 for one per core (default 1)\n");
+    fprintf(stderr, "  -q bytes     output queued for one client before it counts as stalled (default 262144)\n");
+    fprintf(stderr, "  -d           drop new messages for a stalled client instead of disconnecting it\n");
+    fprintf(stderr, "  -l path      log file (default %s)\n", LOG_PATH);
+    fprintf(stderr, "  -L MiB       rotate the log once it reaches this size, 0 never (default 64)\n");
 }
 
-int main() {
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+int main(int argc, char *argv[]) {
+    int port = PORT;
+    int foreground = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:fw:q:dl:L:")) != -1) {
+        if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'f') {
+            foreground = 1;
+        } else if (opt == 'w') {
+            worker_count = atoi(optarg);
+            if (worker_count == 0) {
+                worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        } else if (opt == 'q') {
+            high_water = strtoul(optarg, NULL, 10);
+        } else if (opt == 'd') {
+            drop_when_full = 1;
+        } else if (opt == 'l') {
+            log_path = optarg;
+        } else if (opt == 'L') {
+            log_max_bytes = strtoul(optarg, NULL, 10) << 20;
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (worker_count < 1 || worker_count > BUS_MAX_WORKERS) {
+        print_usage(argv[0]);
+        exit(1);
+    }
 
     struct sigaction sa;
     sa.sa_handler = sigint_handler;
@@ -120,71 +541,53 @@ int main() {
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
-    daemonize();
-
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("socket");
-        exit(1);
+    if (!foreground) {
+        daemonize();
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
-        close(server_sock);
+    raise_fd_limit();
+    bus = bus_create(worker_count);
+    if (!bus) {
         exit(1);
     }
 
-    if (listen(server_sock, 5) < 0) {
-        perror("listen");
-        close(server_sock);
-        exit(1);
+    if (worker_count == 1) {
+        worker_id = 0;
+        log_open(log_path, log_max_bytes);
+        run_worker(port);
+        log_shutdown();
+        log_close();
+        return 0;
     }
 
-    while (1) {
-        int client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_sock < 0) {
-            perror("accept");
-            continue;
+    for (int i = 0; i < worker_count; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        } else if (pid == 0) {
+            worker_id = i;
+            log_open(log_path, log_max_bytes);
+            run_worker(port);
+            log_close();
+            exit(0);
         }
-
-        if (client_count < MAX_CLIENTS) {
-            ClientInfo *client_info = &clients[client_count++];
-            client_info->client_sock = client_sock;
-
-            pipe(client_info->pipe_read);
-            pipe(client_info->pipe_write);
-
-            int n = read(client_sock, client_info->nickname, BUF_SIZE);
-            if (n <= 0) {
-                close(client_sock);
-                continue;
-            }
-
-            pid_t pid = fork();
-            if (pid < 0) {
-                perror("fork");
-                close(client_sock);
-                continue;
-            } else if (pid == 0) {
-                close(server_sock);
-                handle_client(client_info);
-            } else {
-                close(client_sock);
-                close(client_info->pipe_read[1]);
-                close(client_info->pipe_write[0]);
+        worker_pids[i] = pid;
+    }
+    log_open(log_path, log_max_bytes);
+    pid_t pid;
+    while ((pid = wait(NULL)) > 0 || errno == EINTR) {
+        // A worker that dies takes only its own clients with it; the others
+        // skip any bus slot it left half-written.
+        for (int i = 0; i < worker_count; ++i) {
+            if (pid > 0 && worker_pids[i] == pid) {
+                bus_mark_dead(bus, i);
             }
-        } else {
-            log_message("Maximum number of clients reached.");
-            close(client_sock);
         }
     }
-
-    close(server_sock);
+    if (stop_signal) {
+        log_shutdown();
+    }
+    log_close();
     return 0;
 }
-